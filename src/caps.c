@@ -0,0 +1,387 @@
+#include "caps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <err.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <jansson.h>
+
+#include "qmp.h"
+#include "xdg.h"
+#include "util.h"
+
+/* how long to give qemu to come up for probing */
+#define PROBE_TIMEOUT_MS 10000
+
+/*
+ * What a qemu binary supports doesn't change until the binary does, so
+ * the result of probing it is cached as json under $XDG_CACHE_HOME,
+ * keyed by its path and validated against its inode and mtime.
+ */
+
+static char *find_binary(const char *name)
+{
+    const char *path = getenv("PATH");
+    if (strchr(name, '/'))
+        return realpath(name, NULL);
+    if (!path)
+        path = "/usr/local/bin:/usr/bin:/bin";
+
+    while (*path) {
+        size_t len = strcspn(path, ":");
+        _cleanup_free_ char *candidate = NULL;
+
+        asprintf(&candidate, "%.*s/%s", (int)len, path, name);
+        if (access(candidate, X_OK) == 0)
+            return realpath(candidate, NULL);
+
+        path += len;
+        path += strspn(path, ":");
+    }
+
+    return NULL;
+}
+
+static char *cache_path(const char *binary)
+{
+    char *path = NULL, *p;
+
+    asprintf(&path, "%s/qemu-monitor/caps%s.json", get_user_cache_dir(), binary);
+    for (p = strstr(path, "/caps") + 5; *p; ++p) {
+        if (*p == '/')
+            *p = '_';
+    }
+
+    return path;
+}
+
+static json_t *names(json_t *list, const char *key)
+{
+    json_t *result = json_array();
+    json_t *value;
+    size_t idx;
+
+    json_array_foreach(list, idx, value) {
+        json_t *name = json_object_get(value, key);
+        if (json_is_string(name))
+            json_array_append(result, name);
+    }
+
+    return result;
+}
+
+static json_t *machine_names(json_t *machines)
+{
+    json_t *result = names(machines, "name");
+    json_t *value;
+    size_t idx;
+
+    /* aliases like "pc" and "q35" are valid machine types too */
+    json_array_foreach(machines, idx, value) {
+        json_t *alias = json_object_get(value, "alias");
+        if (json_is_string(alias))
+            json_array_append(result, alias);
+    }
+
+    return result;
+}
+
+static json_t *option_params(json_t *options)
+{
+    json_t *result = json_object();
+    json_t *value;
+    size_t idx;
+
+    json_array_foreach(options, idx, value) {
+        const char *option = json_string_value(json_object_get(value, "option"));
+        if (option)
+            json_object_set_new(result, option, names(json_object_get(value, "parameters"), "name"));
+    }
+
+    return result;
+}
+
+static bool contains(json_t *list, const char *name)
+{
+    json_t *value;
+    size_t idx;
+
+    json_array_foreach(list, idx, value) {
+        const char *str = json_string_value(value);
+        if (str && streq(str, name))
+            return true;
+    }
+
+    return false;
+}
+
+/* the introspected schema hides type names, so look for the aio enum by its values */
+static json_t *aio_modes(json_t *schema)
+{
+    json_t *value;
+    size_t idx;
+
+    json_array_foreach(schema, idx, value) {
+        const char *meta = json_string_value(json_object_get(value, "meta-type"));
+        if (!meta || !streq(meta, "enum"))
+            continue;
+
+        json_t *values = json_object_get(value, "values");
+        if (contains(values, "threads") && contains(values, "native"))
+            return json_incref(values);
+    }
+
+    return json_array();
+}
+
+static json_t *probe(const char *binary)
+{
+    _cleanup_free_ char *sockpath = NULL;
+    _cleanup_free_ char *qmparg = NULL;
+
+    asprintf(&sockpath, "%s/probe-%d", get_user_runtime_dir(), getpid());
+    asprintf(&qmparg, "unix:%s", sockpath);
+
+    _cleanup_close_ int fd = qmp_listen(sockpath);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        err(1, "failed to fork");
+    } else if (pid == 0) {
+        execl(binary, binary, "-machine", "none", "-nodefaults", "-display", "none",
+              "-S", "-monitor", "none", "-qmp", qmparg, NULL);
+        err(1, "failed to exec %s", binary);
+    }
+
+    json_t *caps = NULL;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, PROBE_TIMEOUT_MS) == 1) {
+        int cfd = qmp_accept(fd);
+        _cleanup_json_ json_t *machines = qmp_execute(cfd, "query-machines", NULL);
+        _cleanup_json_ json_t *cpus = qmp_execute(cfd, "query-cpu-definitions", NULL);
+        _cleanup_json_ json_t *types = qmp_execute(cfd, "qom-list-types",
+                                                   json_pack("{s:b}", "abstract", 0));
+        _cleanup_json_ json_t *options = qmp_execute(cfd, "query-command-line-options", NULL);
+        _cleanup_json_ json_t *schema = qmp_execute(cfd, "query-qmp-schema", NULL);
+
+        if (machines && cpus && types && options) {
+            caps = json_object();
+            json_object_set_new(caps, "machines", machine_names(machines));
+            json_object_set_new(caps, "cpus", names(cpus, "name"));
+            json_object_set_new(caps, "types", names(types, "name"));
+            json_object_set_new(caps, "options", option_params(options));
+            json_object_set_new(caps, "aio", aio_modes(schema));
+        }
+
+        qmp_command(cfd, "quit");
+        qmp_close(cfd);
+    } else {
+        warnx("%s didn't connect for probing", binary);
+        kill(pid, SIGKILL);
+    }
+
+    waitpid(pid, NULL, 0);
+    unlink(sockpath);
+    return caps;
+}
+
+static void save_cache(json_t *caps, const char *path)
+{
+    _cleanup_free_ char *dir = NULL;
+    _cleanup_free_ char *tmppath = NULL;
+
+    asprintf(&dir, "%s/qemu-monitor", get_user_cache_dir());
+    mkdir(get_user_cache_dir(), 0700);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return;
+
+    asprintf(&tmppath, "%s.tmp", path);
+    if (json_dump_file(caps, tmppath, JSON_COMPACT) < 0 || rename(tmppath, path) < 0)
+        unlink(tmppath);
+}
+
+json_t *caps_load(const char *name)
+{
+    struct stat st;
+
+    _cleanup_free_ char *binary = find_binary(name);
+    if (!binary || stat(binary, &st) < 0)
+        return NULL;
+
+    _cleanup_free_ char *path = cache_path(binary);
+    json_t *caps = json_load_file(path, 0, NULL);
+
+    if (caps &&
+        json_integer_value(json_object_get(caps, "inode")) == (json_int_t)st.st_ino &&
+        json_integer_value(json_object_get(caps, "mtime")) == (json_int_t)st.st_mtime)
+        return caps;
+
+    if (caps)
+        json_decref(caps);
+
+    caps = probe(binary);
+    if (!caps)
+        return NULL;
+
+    json_object_set_new(caps, "path", json_string(binary));
+    json_object_set_new(caps, "inode", json_integer(st.st_ino));
+    json_object_set_new(caps, "mtime", json_integer(st.st_mtime));
+    save_cache(caps, path);
+    return caps;
+}
+
+bool caps_has_machine(json_t *caps, const char *name)
+{
+    return contains(json_object_get(caps, "machines"), name);
+}
+
+bool caps_has_cpu(json_t *caps, const char *name)
+{
+    return contains(json_object_get(caps, "cpus"), name);
+}
+
+bool caps_has_type(json_t *caps, const char *name)
+{
+    return contains(json_object_get(caps, "types"), name);
+}
+
+bool caps_has_aio(json_t *caps, const char *mode)
+{
+    return contains(json_object_get(caps, "aio"), mode);
+}
+
+bool caps_has_option(json_t *caps, const char *option, const char *param)
+{
+    return contains(json_object_get(json_object_get(caps, "options"), option), param);
+}
+
+static const char *vga_type(const char *vga)
+{
+    static const struct {
+        const char *name;
+        const char *type;
+    } vgas[] = {
+        { "std",    "VGA" },
+        { "cirrus", "cirrus-vga" },
+        { "vmware", "vmware-svga" },
+        { "qxl",    "qxl-vga" },
+        { "virtio", "virtio-vga" },
+        { "bochs",  "bochs-display" },
+        { "none",   NULL },
+    };
+    size_t idx;
+
+    for (idx = 0; idx < sizeof(vgas) / sizeof(vgas[0]); ++idx) {
+        if (streq(vgas[idx].name, vga))
+            return vgas[idx].type;
+    }
+
+    return vga;
+}
+
+static int require_type(json_t *caps, const char *key, const char *value, const char *type)
+{
+    if (!type || caps_has_type(caps, type))
+        return 0;
+
+    warnx("%s=%s needs %s, which this qemu doesn't have", key, value, type);
+    return -1;
+}
+
+int caps_check_config(json_t *caps, const struct qemu_config_t *config)
+{
+    size_t idx;
+    int rc = 0;
+
+    if (config->machine && !caps_has_machine(caps, config->machine)) {
+        warnx("Machine=%s isn't a machine type this qemu knows", config->machine);
+        rc = -1;
+    }
+
+    if (config->cpu) {
+        _cleanup_free_ char *model = strndup(config->cpu, strcspn(config->cpu, ","));
+
+        /* host and max aren't listed without an accelerator */
+        if (!streq(model, "host") && !streq(model, "max") && !caps_has_cpu(caps, model)) {
+            warnx("CPU=%s isn't a cpu model this qemu knows", model);
+            rc = -1;
+        }
+    }
+
+    for (idx = 0; idx < config->disks_len; ++idx) {
+        const char *interface = config->disks[idx].interface;
+        if (interface && streq(interface, "virtio"))
+            rc |= require_type(caps, "Interface", "virtio", "virtio-blk-pci");
+    }
+
+    for (idx = 0; idx < config->nics_len; ++idx) {
+        const char *model = config->nics[idx].model;
+        rc |= require_type(caps, "Model", model ? model : "(default)", nic_driver(model));
+    }
+
+    if (config->graphics && !streq(config->graphics, "none"))
+        rc |= require_type(caps, "Graphics", config->graphics, vga_type(config->graphics));
+    if (config->max_memory_size) {
+        char size[32];
+        snprintf(size, sizeof(size), "%" PRIu64 "M", config->max_memory_size >> 20);
+        rc |= require_type(caps, "MaxMemory", size, "virtio-mem-pci");
+    }
+    if (config->guest_agent)
+        rc |= require_type(caps, "GuestAgent", "yes", "virtserialport");
+    if (config->template || config->clone)
+        rc |= require_type(caps, "Template", config->template_dir, "memory-backend-file");
+
+    return rc;
+}
+
+/*
+ * qemu being built with io_uring says nothing about whether this kernel
+ * lets us use it (io_uring_disabled, seccomp, containers), so ask the
+ * kernel every time rather than caching it with the binary's caps.
+ */
+static bool io_uring_allowed(void)
+{
+#ifdef __NR_io_uring_setup
+    /* large enough for struct io_uring_params, which has to be zeroed */
+    uint32_t params[32] = { 0 };
+
+    int fd = syscall(__NR_io_uring_setup, 1, params);
+    if (fd < 0)
+        return false;
+
+    close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void caps_pick_backends(json_t *caps, struct qemu_config_t *config)
+{
+    size_t idx;
+
+    /* disks besides overlays are opened O_DIRECT, so native aio works for them if io_uring isn't around */
+    if (!config->disk_aio && caps_has_option(caps, "drive", "aio")) {
+        if (caps_has_aio(caps, "io_uring") && io_uring_allowed())
+            config->disk_aio = config_strdup(config, "io_uring");
+        else if (caps_has_aio(caps, "native"))
+            config->disk_aio = config_strdup(config, "native");
+    }
+
+    /* let the kernel move packets for virtio nics when it can */
+    bool vhost = access("/dev/vhost-net", R_OK | W_OK) == 0;
+    for (idx = 0; idx < config->nics_len; ++idx) {
+        struct nic_config *nic = &config->nics[idx];
+        if (vhost && nic->interface && streq(nic_driver(nic->model), "virtio-net-pci"))
+            nic->vhost = true;
+    }
+}
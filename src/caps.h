@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <jansson.h>
+
+#include "config.h"
+
+json_t *caps_load(const char *name);
+
+bool caps_has_machine(json_t *caps, const char *name);
+bool caps_has_cpu(json_t *caps, const char *name);
+bool caps_has_type(json_t *caps, const char *name);
+bool caps_has_aio(json_t *caps, const char *mode);
+bool caps_has_option(json_t *caps, const char *option, const char *param);
+
+int caps_check_config(json_t *caps, const struct qemu_config_t *config);
+void caps_pick_backends(json_t *caps, struct qemu_config_t *config);
@@ -2,41 +2,573 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <err.h>
 #include "util.h"
 
 #define WHITESPACE " \t\r\n"
 
-static char *strstripped(const char *s, size_t length)
+/* profiles are small, most fit in a single block */
+#define ARENA_BLOCK 4096
+
+/*
+ * Values are copied out of the profile into a chain of blocks owned by
+ * the config. Setting a key again simply points it at a new copy; the
+ * old one is released along with everything else in config_free.
+ */
+struct config_arena {
+    struct config_arena *next;
+    size_t len;
+    size_t size;
+    char data[];
+};
+
+enum config_type {
+    CONFIG_STRING,
+    CONFIG_BOOLEAN,
+    CONFIG_TRISTATE,
+    CONFIG_SIZE,
+    CONFIG_UNSIGNED,
+    CONFIG_MSEC
+};
+
+/* which struct a key's offset is relative to */
+enum config_target {
+    TARGET_MAIN,
+    TARGET_DISK,
+    TARGET_NIC
+};
+
+struct config_key {
+    const char *name;
+    enum config_target target;
+    enum config_type type;
+    size_t offset;
+    uint64_t unit;
+    const char *const *values;
+};
+
+struct config_section {
+    const char *name;
+    const struct config_key *keys;
+    size_t len;
+};
+
+struct parser {
+    const char *path;
+    unsigned lineno;
+    struct qemu_config_t *config;
+    const struct config_section *section;
+    struct disk_config *disk;
+    struct nic_config *nic;
+    unsigned disk_lines[CONFIG_MAX_DISKS];
+    int rc;
+};
+
+static const char *const disk_interfaces[] = {
+    "ide", "scsi", "sd", "mtd", "floppy", "pflash", "virtio", "none", NULL
+};
+
+#define MAIN(key, type, field, ...) \
+    { key, TARGET_MAIN, type, offsetof(struct qemu_config_t, field), __VA_ARGS__ }
+#define DISK(key, type, field, ...) \
+    { key, TARGET_DISK, type, offsetof(struct disk_config, field), __VA_ARGS__ }
+#define NIC(key, type, field, ...) \
+    { key, TARGET_NIC, type, offsetof(struct nic_config, field), __VA_ARGS__ }
+
+static const struct config_key main_keys[] = {
+    MAIN("Machine",                     CONFIG_STRING,   machine, 0, NULL),
+    MAIN("CPU",                         CONFIG_STRING,   cpu, 0, NULL),
+    MAIN("SMP",                         CONFIG_STRING,   smp, 0, NULL),
+    MAIN("Memory",                      CONFIG_SIZE,     memory_size, 1 << 20, NULL),
+    MAIN("MaxMemory",                   CONFIG_SIZE,     max_memory_size, 1 << 20, NULL),
+    MAIN("MemoryFile",                  CONFIG_STRING,   memory_file, 0, NULL),
+    MAIN("MemoryMerge",                 CONFIG_TRISTATE, memory_merge, 0, NULL),
+    MAIN("DisableTransparentHugePages", CONFIG_BOOLEAN,  disable_hugepages, 0, NULL),
+    MAIN("KSMMinPagesToScan",           CONFIG_UNSIGNED, ksm_min_pages, 0, NULL),
+    MAIN("KSMMaxPagesToScan",           CONFIG_UNSIGNED, ksm_max_pages, 0, NULL),
+    MAIN("DiskInterface",               CONFIG_STRING,   disk_interface, 0, disk_interfaces),
+    MAIN("RealTimeClock",               CONFIG_STRING,   rtc, 0, NULL),
+    MAIN("Graphics",                    CONFIG_STRING,   graphics, 0, NULL),
+    MAIN("SoundHardware",               CONFIG_STRING,   soundhw, 0, NULL),
+    MAIN("SerialPort",                  CONFIG_STRING,   serial, 0, NULL),
+    MAIN("GuestAgent",                  CONFIG_BOOLEAN,  guest_agent, 0, NULL),
+    MAIN("IOLatencyTarget",             CONFIG_MSEC,     io_latency_target, 0, NULL),
+    MAIN("Template",                    CONFIG_STRING,   template_dir, 0, NULL),
+    MAIN("SnapshotDirectory",           CONFIG_STRING,   snapshot_dir, 0, NULL),
+    MAIN("SnapshotClusterSize",         CONFIG_SIZE,     cluster_size, 1, NULL),
+    MAIN("Prewarm",                     CONFIG_BOOLEAN,  prewarm, 0, NULL),
+
+    /* profiles from before [Disk] and [Network] describe the first of each */
+    DISK("Disk",                        CONFIG_STRING,   path, 0, NULL),
+    NIC("NetInterface",                 CONFIG_STRING,   interface, 0, NULL),
+    NIC("NetModel",                     CONFIG_STRING,   model, 0, NULL),
+    NIC("NetMacAddress",                CONFIG_STRING,   macaddr, 0, NULL)
+};
+
+static const struct config_key disk_keys[] = {
+    DISK("Path",                        CONFIG_STRING,   path, 0, NULL),
+    DISK("Interface",                   CONFIG_STRING,   interface, 0, disk_interfaces),
+    DISK("ReadOnly",                    CONFIG_BOOLEAN,  readonly, 0, NULL)
+};
+
+static const struct config_key nic_keys[] = {
+    NIC("Interface",                    CONFIG_STRING,   interface, 0, NULL),
+    NIC("Model",                        CONFIG_STRING,   model, 0, NULL),
+    NIC("MacAddress",                   CONFIG_STRING,   macaddr, 0, NULL)
+};
+
+#define SECTION(name, keys) { name, keys, sizeof(keys) / sizeof(keys[0]) }
+
+static const struct config_section sections[] = {
+    SECTION(NULL,      main_keys),
+    SECTION("Disk",    disk_keys),
+    SECTION("Network", nic_keys)
+};
+
+static void *arena_alloc(struct qemu_config_t *config, size_t len)
 {
-    char *new = NULL;
-    size_t idx, skipped = strspn(s, WHITESPACE);
-    length -= skipped;
+    struct config_arena *arena = config->arena;
 
-    if (length > 0) {
-        new = strndup(&s[skipped], length);
+    if (!arena || arena->size - arena->len < len) {
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
 
-        for (idx = length; idx != 0; --idx) {
-            if (!strchr(WHITESPACE, new[idx]))
-                break;
-        }
+        arena = malloc(sizeof(struct config_arena) + size);
+        if (!arena)
+            err(1, "failed to allocate config");
+
+        arena->next = config->arena;
+        arena->len = 0;
+        arena->size = size;
+        config->arena = arena;
+    }
+
+    void *ptr = &arena->data[arena->len];
+    arena->len += len;
+    return ptr;
+}
+
+char *config_strdup(struct qemu_config_t *config, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(config, len), s, len);
+}
+
+char *config_printf(struct qemu_config_t *config, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char *str = arena_alloc(config, len + 1);
+
+    va_start(ap, fmt);
+    vsnprintf(str, len + 1, fmt, ap);
+    va_end(ap);
+
+    return str;
+}
+
+static void copy_string(struct qemu_config_t *config, char **s)
+{
+    if (*s)
+        *s = config_strdup(config, *s);
+}
+
+void config_copy(struct qemu_config_t *dst, const struct qemu_config_t *src)
+{
+    size_t idx;
+
+    *dst = *src;
+    dst->arena = NULL;
+
+    char **strings[] = {
+        &dst->machine, &dst->cpu, &dst->smp, &dst->memory_file,
+        &dst->disk_interface, &dst->disk_aio, &dst->rtc, &dst->graphics,
+        &dst->soundhw, &dst->serial, &dst->template_dir, &dst->snapshot_dir
+    };
+
+    for (idx = 0; idx < sizeof(strings) / sizeof(strings[0]); ++idx)
+        copy_string(dst, strings[idx]);
+
+    for (idx = 0; idx < dst->disks_len; ++idx) {
+        struct disk_config *disk = &dst->disks[idx];
+        copy_string(dst, &disk->path);
+        copy_string(dst, &disk->interface);
+        copy_string(dst, &disk->backing);
+        copy_string(dst, &disk->overlay);
+    }
+
+    for (idx = 0; idx < dst->nics_len; ++idx) {
+        struct nic_config *nic = &dst->nics[idx];
+        copy_string(dst, &nic->interface);
+        copy_string(dst, &nic->model);
+        copy_string(dst, &nic->macaddr);
+    }
+}
+
+static char *strstrip(char *s)
+{
+    size_t len;
+
+    s += strspn(s, WHITESPACE);
+    for (len = strlen(s); len && strchr(WHITESPACE, s[len - 1]); --len)
+        ;
+
+    s[len] = '\0';
+    return s;
+}
+
+static _printf_(2,3) void parse_error(struct parser *p, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "%s: %s:%u: ", program_invocation_short_name, p->path, p->lineno);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+
+    p->rc = -1;
+}
+
+static struct disk_config *new_disk(struct parser *p)
+{
+    struct qemu_config_t *config = p->config;
+
+    if (config->disks_len == CONFIG_MAX_DISKS) {
+        parse_error(p, "too many disks, at most %d are supported", CONFIG_MAX_DISKS);
+        return NULL;
+    }
+
+    p->disk_lines[config->disks_len] = p->lineno;
+    return &config->disks[config->disks_len++];
+}
+
+static struct nic_config *new_nic(struct parser *p)
+{
+    struct qemu_config_t *config = p->config;
+
+    if (config->nics_len == CONFIG_MAX_NICS) {
+        parse_error(p, "too many nics, at most %d are supported", CONFIG_MAX_NICS);
+        return NULL;
+    }
+
+    return &config->nics[config->nics_len++];
+}
+
+static void *key_target(struct parser *p, const struct config_key *key, bool create)
+{
+    switch (key->target) {
+    case TARGET_MAIN:
+        return p->config;
+    case TARGET_DISK:
+        if (!p->disk && create)
+            p->disk = new_disk(p);
+        return p->disk;
+    case TARGET_NIC:
+        if (!p->nic && create)
+            p->nic = new_nic(p);
+        return p->nic;
+    }
+
+    return NULL;
+}
+
+static bool one_of(const char *const *values, const char *value)
+{
+    for (; *values; ++values) {
+        if (streq(*values, value))
+            return true;
+    }
+
+    return false;
+}
+
+static int parse_value(struct parser *p, const struct config_key *key, void *field, const char *value)
+{
+    char *end;
+
+    switch (key->type) {
+    case CONFIG_STRING:
+        if (key->values && !one_of(key->values, value))
+            return -EINVAL;
+        *(char **)field = config_strdup(p->config, value);
+        return 0;
+    case CONFIG_BOOLEAN:
+    case CONFIG_TRISTATE: {
+        bool enabled;
+
+        if (streq(value, "yes") || streq(value, "true") || streq(value, "on") || streq(value, "1"))
+            enabled = true;
+        else if (streq(value, "no") || streq(value, "false") || streq(value, "off") || streq(value, "0"))
+            enabled = false;
+        else
+            return -EINVAL;
+
+        if (key->type == CONFIG_BOOLEAN)
+            *(bool *)field = enabled;
+        else
+            *(enum tristate *)field = enabled ? TRISTATE_YES : TRISTATE_NO;
+        return 0;
+    }
+    case CONFIG_SIZE:
+        return parse_size(value, key->unit, field);
+    case CONFIG_UNSIGNED: {
+        /* counts, not sizes, so no suffixes */
+        if (!isdigit((unsigned char)*value))
+            return -EINVAL;
+
+        errno = 0;
+        unsigned long long n = strtoull(value, &end, 10);
+        if (errno || *end)
+            return -EINVAL;
+        *(uint64_t *)field = n;
+        return 0;
+    }
+    case CONFIG_MSEC: {
+        /* in milliseconds, kept as microseconds */
+        double msec = strtod(value, &end);
+        if (end == value || *end || !isfinite(msec) || msec < 0)
+            return -EINVAL;
+        /* UINT64_MAX rounds up as a double, so stay strictly below it */
+        if (msec * 1000 >= (double)UINT64_MAX)
+            return -ERANGE;
+        *(uint64_t *)field = msec * 1000;
+        return 0;
+    }
+    }
+
+    return -EINVAL;
+}
+
+static void reset_value(const struct config_key *key, void *field)
+{
+    switch (key->type) {
+    case CONFIG_STRING:
+        *(char **)field = NULL;
+        break;
+    case CONFIG_BOOLEAN:
+        *(bool *)field = false;
+        break;
+    case CONFIG_TRISTATE:
+        *(enum tristate *)field = TRISTATE_DEFAULT;
+        break;
+    case CONFIG_SIZE:
+    case CONFIG_UNSIGNED:
+    case CONFIG_MSEC:
+        *(uint64_t *)field = 0;
+        break;
+    }
+}
+
+static void parse_section(struct parser *p, char *line)
+{
+    size_t idx, len = strlen(line);
+
+    if (line[len - 1] != ']') {
+        parse_error(p, "unterminated section header");
+        p->section = NULL;
+        return;
+    }
+
+    line[len - 1] = '\0';
+    line = strstrip(line + 1);
+
+    for (idx = 1; idx < sizeof(sections) / sizeof(sections[0]); ++idx) {
+        if (streq(sections[idx].name, line))
+            break;
+    }
+
+    p->disk = NULL;
+    p->nic = NULL;
 
-        new[idx + 1] = 0;
+    if (idx == sizeof(sections) / sizeof(sections[0])) {
+        warnx("%s:%u: unknown section [%s], ignoring", p->path, p->lineno, line);
+        p->section = NULL;
+        return;
     }
 
-    return new;
+    if (sections[idx].keys == disk_keys)
+        p->disk = new_disk(p);
+    else
+        p->nic = new_nic(p);
+
+    /* skip the section's keys if there was no room for another device */
+    p->section = p->disk || p->nic ? &sections[idx] : NULL;
 }
 
-void split_key_value(const char *line, char **key, char **value)
+static void parse_line(struct parser *p, char *line)
 {
-    size_t length = strcspn(line, "#");
-    if (length == 0) {
-        *key = *value = NULL;
+    char *sep = strchr(line, '=');
+    if (!sep) {
+        parse_error(p, "expected Key=Value");
         return;
     }
 
-    const char *sep = memchr(line, '=', length);
+    *sep = '\0';
+    const char *key = strstrip(line);
+    const char *value = strstrip(sep + 1);
+
+    const struct config_section *section = p->section;
+    const struct config_key *match = NULL;
+    size_t idx;
+
+    for (idx = 0; idx < section->len; ++idx) {
+        if (streq(section->keys[idx].name, key)) {
+            match = &section->keys[idx];
+            break;
+        }
+    }
+
+    if (!match) {
+        if (section->name)
+            warnx("%s:%u: unknown key %s in [%s], ignoring", p->path, p->lineno, key, section->name);
+        else
+            warnx("%s:%u: unknown key %s, ignoring", p->path, p->lineno, key);
+        return;
+    }
+
+    /* an empty value puts the key back to its default */
+    char *base = key_target(p, match, value[0] != '\0');
+    if (!base)
+        return;
+
+    if (!value[0])
+        reset_value(match, base + match->offset);
+    else if (parse_value(p, match, base + match->offset, value) < 0)
+        parse_error(p, "invalid %s=%s", key, value);
+}
+
+int config_read(const char *path, struct qemu_config_t *config)
+{
+    _cleanup_fclose_ FILE *fp = fopen(path, "re");
+    if (fp == NULL) {
+        warn("couldn't open %s", path);
+        return -1;
+    }
+
+    struct parser p = {
+        .path = path,
+        .config = config,
+        .section = &sections[0]
+    };
+
+    _cleanup_free_ char *buf = NULL;
+    size_t len = 0;
+    size_t idx;
+
+    while (getline(&buf, &len, fp) != -1) {
+        p.lineno++;
+
+        buf[strcspn(buf, "#")] = '\0';
+        char *line = strstrip(buf);
+
+        if (!line[0])
+            continue;
+        else if (line[0] == '[')
+            parse_section(&p, line);
+        else if (p.section)
+            parse_line(&p, line);
+    }
+
+    for (idx = 0; idx < config->disks_len; ++idx) {
+        struct disk_config *disk = &config->disks[idx];
+
+        if (!disk->path) {
+            p.lineno = p.disk_lines[idx];
+            parse_error(&p, "disk has no Path=");
+        }
+
+        /* DiskInterface= is the default for every disk */
+        if (!disk->interface)
+            disk->interface = config->disk_interface;
+    }
+
+    return p.rc;
+}
+
+int parse_size(const char *value, uint64_t unit, uint64_t *size)
+{
+    uint64_t frac = 0, scale = 1;
+    char *end;
+
+    /* strtoull would happily negate "-1" */
+    if (!isdigit((unsigned char)*value))
+        return -EINVAL;
+
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno)
+        return -errno;
+
+    if (*end == '.') {
+        /* digits past the sixth are dropped, it keeps frac * unit in range */
+        for (++end; isdigit((unsigned char)*end); ++end) {
+            if (scale < 1000000) {
+                frac = frac * 10 + (*end - '0');
+                scale *= 10;
+            }
+        }
+    }
+
+    switch (*end) {
+    case 'T': case 't': unit = 1ULL << 40; break;
+    case 'G': case 'g': unit = 1ULL << 30; break;
+    case 'M': case 'm': unit = 1ULL << 20; break;
+    case 'K': case 'k': unit = 1ULL << 10; break;
+    case 'B': case 'b': unit = 1; break;
+    case '\0': break;
+    default: return -EINVAL;
+    }
+
+    if (*end) {
+        bool bytes = *end == 'B' || *end == 'b';
+
+        /* "G", "GB" and "GiB" all mean the same */
+        ++end;
+        if (!bytes && (streq(end, "B") || streq(end, "b") || streq(end, "iB")))
+            end += strlen(end);
+        if (*end)
+            return -EINVAL;
+    }
+
+    if (n > UINT64_MAX / unit)
+        return -ERANGE;
+    n *= unit;
+
+    uint64_t part = frac * unit / scale;
+    if (n > UINT64_MAX - part)
+        return -ERANGE;
+
+    *size = n + part;
+    return 0;
+}
+
+const char *nic_driver(const char *model)
+{
+    if (!model)
+        return "e1000";
+    if (streq(model, "virtio"))
+        return "virtio-net-pci";
+    return model;
+}
+
+void config_free(struct qemu_config_t *config)
+{
+    struct config_arena *arena = config->arena;
+
+    while (arena) {
+        struct config_arena *next = arena->next;
+        free(arena);
+        arena = next;
+    }
 
-    *key = strstripped(line, sep - line);
-    *value = strstripped(sep + 1, length - (sep - line) - 1);
+    zero(config, sizeof(struct qemu_config_t));
 }
@@ -1,3 +1,88 @@
 #pragma once
 
-void split_key_value(const char *line, char **key, char **value);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define CONFIG_MAX_DISKS 8
+#define CONFIG_MAX_NICS 8
+
+struct config_arena;
+
+/* for settings where leaving them out means qemu's or the kernel's default */
+enum tristate {
+    TRISTATE_DEFAULT,
+    TRISTATE_NO,
+    TRISTATE_YES
+};
+
+struct disk_config {
+    char *path;
+    char *interface;
+    char *backing;
+    char *overlay;
+
+    bool readonly;
+    /* read ahead from a recorded profile, so not worth recording again */
+    bool prewarmed;
+};
+
+struct nic_config {
+    char *interface;
+    char *model;
+    char *macaddr;
+
+    bool vhost;
+};
+
+struct qemu_config_t {
+    /* every string below lives here, and goes away with config_free */
+    struct config_arena *arena;
+
+    char *machine;
+    char *cpu;
+    char *smp;
+    char *memory_file;
+    char *disk_interface;
+    char *disk_aio;
+    char *rtc;
+    char *graphics;
+    char *soundhw;
+    char *serial;
+    char *template_dir;
+    char *snapshot_dir;
+
+    struct disk_config disks[CONFIG_MAX_DISKS];
+    size_t disks_len;
+    struct nic_config nics[CONFIG_MAX_NICS];
+    size_t nics_len;
+
+    uint64_t memory_size;
+    uint64_t max_memory_size;
+    uint64_t cluster_size;
+    uint64_t io_latency_target;
+    uint64_t ksm_min_pages;
+    uint64_t ksm_max_pages;
+
+    enum tristate memory_merge;
+
+    bool disable_hugepages;
+    bool guest_agent;
+    bool prewarm;
+    bool fullscreen;
+    bool snapshot;
+    bool template;
+    bool clone;
+};
+
+int config_read(const char *path, struct qemu_config_t *config);
+void config_copy(struct qemu_config_t *dst, const struct qemu_config_t *src);
+void config_free(struct qemu_config_t *config);
+
+char *config_strdup(struct qemu_config_t *config, const char *s);
+char *config_printf(struct qemu_config_t *config, const char *fmt, ...) _printf_(2,3);
+
+int parse_size(const char *value, uint64_t unit, uint64_t *size);
+const char *nic_driver(const char *model);
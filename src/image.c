@@ -0,0 +1,72 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "argbuilder.h"
+#include "util.h"
+
+static const char qcow2_magic[] = { 'Q', 'F', 'I', '\xfb' };
+
+const char *image_format(const char *path)
+{
+    char magic[sizeof(qcow2_magic)];
+
+    _cleanup_close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, qcow2_magic, sizeof(magic)) == 0)
+        return "qcow2";
+    return "raw";
+}
+
+int image_create_overlay(const char *backing, const char *path, uint64_t cluster_size)
+{
+    const char *format = image_format(backing);
+    if (!format)
+        return -errno;
+
+    /* qemu resolves a relative backing file against the overlay's directory */
+    _cleanup_free_ char *abspath = realpath(backing, NULL);
+    if (!abspath)
+        return -errno;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -errno;
+    } else if (pid == 0) {
+        char **argv;
+        args_t buf;
+
+        args_init(&buf, 32);
+        args_append(&buf, "qemu-img", "create", "-q", "-f", "qcow2", NULL);
+        args_append(&buf, "-F", format, "-b", abspath, NULL);
+        if (cluster_size) {
+            args_printf(&buf, "-o");
+            args_printf(&buf, "cluster_size=%" PRIu64, cluster_size);
+        }
+        args_printf(&buf, "%s", path);
+
+        args_build_argv(&buf, &argv);
+        execvp(argv[0], argv);
+        /* same convention as the shell, so the parent can tell it's missing */
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return -errno;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+        return -ENOENT;
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        return -EIO;
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+const char *image_format(const char *path);
+int image_create_overlay(const char *backing, const char *path, uint64_t cluster_size);
@@ -0,0 +1,312 @@
+#include "iothrottle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <jansson.h>
+
+#include "qmp.h"
+#include "util.h"
+
+/* never throttle a vm below this many iops */
+#define IOTHROTTLE_MIN_IOPS 200
+/* throttled vms may still burst to a multiple of their limit... */
+#define IOTHROTTLE_BURST 2
+/* ...for this many seconds at a time */
+#define IOTHROTTLE_BURST_LENGTH 2
+/* stats not updated in this long belong to a vm that went away */
+#define IOTHROTTLE_STALE_SEC 10
+/* shared by every user's monitors, see units/qemu-monitor.conf */
+#define IOTHROTTLE_STAT_DIR "/run/qemu-monitor/iostat"
+
+/*
+ * Every monitor publishes what each of its vm's disks did over the last
+ * interval under /run/qemu-monitor/iostat/<pid>-<drive>. The directory is
+ * world-writable and sticky like /tmp, so system and user instances see
+ * each other's numbers. Summing everyone's numbers gives the host-wide
+ * picture without needing a central daemon: each monitor then decides on
+ * its own whether its disks are among the heavy consumers.
+ */
+struct iostat {
+    double iops;
+    uint64_t ops;
+    uint64_t time_ns;
+};
+
+static int publish_iostat(struct iothrottle *io, const struct iostat *stat)
+{
+    _cleanup_free_ char *tmppath = NULL;
+    asprintf(&tmppath, "%s.XXXXXX", io->statpath);
+
+    /* the directory is shared, never write through a name someone else picked */
+    int fd = mkostemp(tmppath, O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    FILE *fp;
+    if (fchmod(fd, 0644) < 0 || !(fp = fdopen(fd, "w"))) {
+        int rc = -errno;
+        close(fd);
+        unlink(tmppath);
+        return rc;
+    }
+
+    fprintf(fp, "%f %" PRIu64 " %" PRIu64 "\n", stat->iops, stat->ops, stat->time_ns);
+    if (fclose(fp) != 0 || rename(tmppath, io->statpath) < 0) {
+        unlink(tmppath);
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int pid_owner(pid_t pid, uid_t *uid)
+{
+    char path[32];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    if (stat(path, &st) < 0)
+        return -errno;
+
+    *uid = st.st_uid;
+    return 0;
+}
+
+/*
+ * Anyone can write to the directory, so only trust stats published by
+ * whoever owns the pid they're named after, and only from plain files.
+ */
+static int read_iostat(int dirfd, const char *name, uid_t owner, time_t now, struct iostat *stat)
+{
+    struct stat st;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != owner) {
+        close(fd);
+        return -EPERM;
+    }
+    if (now - st.st_mtime > IOTHROTTLE_STALE_SEC) {
+        close(fd);
+        return -ESTALE;
+    }
+
+    _cleanup_fclose_ FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        close(fd);
+        return -errno;
+    }
+
+    if (fscanf(fp, "%lf %" SCNu64 " %" SCNu64, &stat->iops, &stat->ops, &stat->time_ns) != 3)
+        return -EINVAL;
+    return 0;
+}
+
+static int host_iostat(struct iostat *host, size_t *active)
+{
+    DIR *d = opendir(IOTHROTTLE_STAT_DIR);
+    if (!d)
+        return -errno;
+
+    struct dirent *dp;
+    time_t now = time(NULL);
+
+    while ((dp = readdir(d))) {
+        struct iostat stat;
+        uid_t owner;
+
+        if (strchr(dp->d_name, '.'))
+            continue;
+
+        pid_t pid = strtol(dp->d_name, NULL, 10);
+        if (pid <= 0)
+            continue;
+        int rc = pid_owner(pid, &owner);
+        if (rc == -ENOENT) {
+            /* the sticky bit keeps this to our own leftovers */
+            unlinkat(dirfd(d), dp->d_name, 0);
+            continue;
+        } else if (rc < 0) {
+            continue;
+        }
+
+        if (read_iostat(dirfd(d), dp->d_name, owner, now, &stat) < 0)
+            continue;
+
+        host->iops += stat.iops;
+        host->ops += stat.ops;
+        host->time_ns += stat.time_ns;
+        if (stat.ops)
+            *active += 1;
+    }
+
+    closedir(d);
+    return 0;
+}
+
+static int set_io_limit(struct iothrottle *io, int qmp_fd, uint64_t iops)
+{
+    json_t *args = json_pack("{s:s, s:I, s:I, s:I, s:I, s:I, s:I}",
+                             "device", io->device,
+                             "bps", (json_int_t)0,
+                             "bps_rd", (json_int_t)0,
+                             "bps_wr", (json_int_t)0,
+                             "iops", (json_int_t)iops,
+                             "iops_rd", (json_int_t)0,
+                             "iops_wr", (json_int_t)0);
+
+    if (iops) {
+        json_object_set_new(args, "iops_max", json_integer(iops * IOTHROTTLE_BURST));
+        json_object_set_new(args, "iops_max_length", json_integer(IOTHROTTLE_BURST_LENGTH));
+    }
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "block_set_io_throttle", args);
+    if (!ret)
+        return -1;
+
+    io->limit = iops;
+    return 0;
+}
+
+static json_t *find_blockstats(json_t *blockstats, const char *device)
+{
+    size_t idx;
+    json_t *value;
+
+    json_array_foreach(blockstats, idx, value) {
+        const char *name = json_string_value(json_object_get(value, "device"));
+        if (name && streq(name, device))
+            return json_object_get(value, "stats");
+    }
+
+    return NULL;
+}
+
+static uint64_t stat_value(json_t *stats, const char *key)
+{
+    return json_integer_value(json_object_get(stats, key));
+}
+
+int iothrottle_init(struct iothrottle *io, const char *device, uint64_t target_usec)
+{
+    zero(io, sizeof(struct iothrottle));
+
+    /* normally set up by tmpfiles.d, but root can do it on the spot */
+    mkdir("/run/qemu-monitor", 0755);
+    if (mkdir(IOTHROTTLE_STAT_DIR, 01777) == 0)
+        chmod(IOTHROTTLE_STAT_DIR, 01777);
+    else if (errno != EEXIST)
+        return -errno;
+
+    io->device = device;
+    io->target_usec = target_usec;
+    asprintf(&io->statpath, IOTHROTTLE_STAT_DIR "/%d-%s", getpid(), device);
+    return 0;
+}
+
+void iothrottle_sample(struct iothrottle *io, int qmp_fd)
+{
+    _cleanup_json_ json_t *blockstats = qmp_execute(qmp_fd, "query-blockstats", NULL);
+    json_t *stats = find_blockstats(blockstats, io->device);
+    if (!stats)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const uint64_t ops = stat_value(stats, "rd_operations") + stat_value(stats, "wr_operations");
+    const uint64_t time_ns = stat_value(stats, "rd_total_time_ns") + stat_value(stats, "wr_total_time_ns");
+    const bool first = !io->last_sample.tv_sec && !io->last_sample.tv_nsec;
+    const double elapsed = (now.tv_sec - io->last_sample.tv_sec) +
+                           (now.tv_nsec - io->last_sample.tv_nsec) / 1e9;
+
+    struct iostat vm = {
+        .ops = ops - io->last_ops,
+        .time_ns = time_ns - io->last_time_ns
+    };
+
+    io->last_sample = now;
+    io->last_ops = ops;
+    io->last_time_ns = time_ns;
+
+    if (first || elapsed <= 0)
+        return;
+
+    vm.iops = vm.ops / elapsed;
+    if (publish_iostat(io, &vm) < 0)
+        warn("failed to publish io stats to %s", io->statpath);
+
+    struct iostat host = { 0 };
+    size_t active = 0;
+    if (host_iostat(&host, &active) < 0 || !host.ops || !active)
+        return;
+
+    const double latency_ms = host.time_ns / (double)host.ops / 1e6;
+    const double target_ms = io->target_usec / 1e3;
+
+    if (latency_ms > target_ms) {
+        /* leave it to the heavier vms to back off */
+        if (vm.iops <= host.iops / active)
+            return;
+
+        uint64_t limit = (io->limit ? io->limit : (uint64_t)vm.iops) * 3 / 4;
+        if (limit < IOTHROTTLE_MIN_IOPS)
+            limit = IOTHROTTLE_MIN_IOPS;
+        if (limit == io->limit)
+            return;
+
+        printf("io: host latency %.2fms over target %.2fms, %s doing %.0f of %.0f iops, throttling to %" PRIu64 " iops\n",
+               latency_ms, target_ms, io->device, vm.iops, host.iops, limit);
+        fflush(stdout);
+        set_io_limit(io, qmp_fd, limit);
+    } else if (io->limit && latency_ms < target_ms * 3 / 4) {
+        if (vm.iops < io->limit / 2) {
+            printf("io: host latency %.2fms recovered, %s doing %.0f of %" PRIu64 " allowed iops, lifting throttle\n",
+                   latency_ms, io->device, vm.iops, io->limit);
+            fflush(stdout);
+            set_io_limit(io, qmp_fd, 0);
+        } else {
+            uint64_t limit = io->limit + io->limit / 4;
+
+            printf("io: host latency %.2fms under target %.2fms, relaxing %s to %" PRIu64 " iops\n",
+                   latency_ms, target_ms, io->device, limit);
+            fflush(stdout);
+            set_io_limit(io, qmp_fd, limit);
+        }
+    }
+}
+
+void iothrottle_set_target(struct iothrottle *io, int qmp_fd, uint64_t target_usec)
+{
+    if (!target_usec && io->limit) {
+        printf("io: latency target removed, lifting throttle on %s\n", io->device);
+        fflush(stdout);
+        set_io_limit(io, qmp_fd, 0);
+    }
+
+    io->target_usec = target_usec;
+}
+
+void iothrottle_reset(struct iothrottle *io)
+{
+    /* a freshly plugged drive starts with new counters and no limit */
+    io->last_sample = (struct timespec){ 0 };
+    io->last_ops = 0;
+    io->last_time_ns = 0;
+    io->limit = 0;
+}
+
+void iothrottle_free(struct iothrottle *io)
+{
+    if (io->statpath)
+        unlink(io->statpath);
+    free(io->statpath);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+struct iothrottle {
+    const char *device;
+    uint64_t target_usec;
+    char *statpath;
+
+    struct timespec last_sample;
+    uint64_t last_ops;
+    uint64_t last_time_ns;
+
+    uint64_t limit;
+};
+
+int iothrottle_init(struct iothrottle *io, const char *device, uint64_t target_usec);
+void iothrottle_sample(struct iothrottle *io, int qmp_fd);
+void iothrottle_set_target(struct iothrottle *io, int qmp_fd, uint64_t target_usec);
+void iothrottle_reset(struct iothrottle *io);
+void iothrottle_free(struct iothrottle *io);
@@ -0,0 +1,143 @@
+#include "ksm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "util.h"
+
+#define KSM_SYSFS "/sys/kernel/mm/ksm"
+
+/* with this much of the host's memory available, scan as little as asked */
+#define KSM_RELAXED_PERCENT 50
+/* and with this little, as much as allowed */
+#define KSM_PRESSURED_PERCENT 10
+/* tasks stalled on memory this often (psi avg10) also count as pressure */
+#define KSM_STALL_PERCENT 10.0
+
+/*
+ * ksmd is a single host-wide thread, so every monitor asking for a scan
+ * rate computes it from the same host numbers. Monitors sharing limits
+ * agree on the result, and none of them needs to own the setting.
+ */
+
+static int read_number(const char *name, uint64_t *value)
+{
+    _cleanup_fclose_ FILE *fp = fopen(name, "re");
+    if (!fp)
+        return -errno;
+    if (fscanf(fp, "%" SCNu64, value) != 1)
+        return -EINVAL;
+    return 0;
+}
+
+static int write_number(const char *name, uint64_t value)
+{
+    FILE *fp = fopen(name, "we");
+    if (!fp)
+        return -errno;
+
+    fprintf(fp, "%" PRIu64 "\n", value);
+    if (fclose(fp) != 0)
+        return -errno;
+    return 0;
+}
+
+bool ksm_running(void)
+{
+    uint64_t run;
+    return read_number(KSM_SYSFS "/run", &run) == 0 && run == 1;
+}
+
+int ksm_read_stat(pid_t pid, struct ksm_stat *stat)
+{
+    char path[64], key[64];
+    int64_t value;
+
+    zero(stat, sizeof(struct ksm_stat));
+
+    snprintf(path, sizeof(path), "/proc/%d/ksm_stat", pid);
+    _cleanup_fclose_ FILE *fp = fopen(path, "re");
+    if (!fp) {
+        /* older kernels only have the page count */
+        snprintf(path, sizeof(path), "/proc/%d/ksm_merging_pages", pid);
+        return read_number(path, &stat->merging_pages);
+    }
+
+    while (fscanf(fp, "%63s %" SCNd64, key, &value) == 2) {
+        if (streq(key, "ksm_merging_pages")) {
+            stat->merging_pages = value;
+        } else if (streq(key, "ksm_process_profit")) {
+            stat->profit = value;
+            stat->has_profit = true;
+        }
+    }
+
+    return 0;
+}
+
+static int available_percent(void)
+{
+    _cleanup_fclose_ FILE *fp = fopen("/proc/meminfo", "re");
+    if (!fp)
+        return -errno;
+
+    char key[64];
+    uint64_t value, total = 0, available = 0;
+
+    while (fscanf(fp, "%63s %" SCNu64 " kB", key, &value) == 2) {
+        if (streq(key, "MemTotal:"))
+            total = value;
+        else if (streq(key, "MemAvailable:"))
+            available = value;
+    }
+
+    if (!total)
+        return -EINVAL;
+    return available * 100 / total;
+}
+
+static bool memory_stalled(void)
+{
+    _cleanup_fclose_ FILE *fp = fopen("/proc/pressure/memory", "re");
+    double avg10;
+
+    return fp && fscanf(fp, "some avg10=%lf", &avg10) == 1 && avg10 >= KSM_STALL_PERCENT;
+}
+
+int ksm_tune(uint64_t min_pages, uint64_t max_pages)
+{
+    uint64_t current, pages;
+
+    if (min_pages > max_pages)
+        min_pages = max_pages;
+
+    int available = available_percent();
+    if (available < 0)
+        return available;
+
+    if (available >= KSM_RELAXED_PERCENT)
+        pages = min_pages;
+    else if (available <= KSM_PRESSURED_PERCENT || memory_stalled())
+        pages = max_pages;
+    else
+        pages = min_pages + (max_pages - min_pages) * (KSM_RELAXED_PERCENT - available) /
+                            (KSM_RELAXED_PERCENT - KSM_PRESSURED_PERCENT);
+
+    int rc = read_number(KSM_SYSFS "/pages_to_scan", &current);
+    if (rc < 0)
+        return rc;
+    if (current == pages)
+        return 0;
+
+    rc = write_number(KSM_SYSFS "/pages_to_scan", pages);
+    if (rc < 0)
+        return rc;
+
+    printf("ksm: %d%% of host memory available, scanning %" PRIu64 " pages at a time (was %" PRIu64 ")\n",
+           available, pages, current);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ksm_stat {
+    uint64_t merging_pages;
+    int64_t profit;
+    bool has_profit;
+};
+
+bool ksm_running(void);
+int ksm_read_stat(pid_t pid, struct ksm_stat *stat);
+int ksm_tune(uint64_t min_pages, uint64_t max_pages);
@@ -0,0 +1,75 @@
+#include "notify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/un.h>
+
+#include "util.h"
+
+/*
+ * A minimal implementation of sd_notify(3). The protocol is just a
+ * datagram of newline separated assignments sent to $NOTIFY_SOCKET,
+ * which isn't worth pulling in libsystemd for.
+ */
+int notify(const char *state)
+{
+    union {
+        struct sockaddr sa;
+        struct sockaddr_un un;
+    } sa = { .un.sun_family = AF_UNIX };
+
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (!path || !path[0])
+        return 0;
+
+    size_t len = strlen(path);
+    if ((path[0] != '/' && path[0] != '@') || len >= UNIX_PATH_MAX)
+        return -EINVAL;
+
+    memcpy(sa.un.sun_path, path, len);
+    if (sa.un.sun_path[0] == '@')
+        sa.un.sun_path[0] = '\0';
+
+    _cleanup_close_ int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    socklen_t salen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, &sa.sa, salen) < 0)
+        return -errno;
+
+    return 1;
+}
+
+int notifyf(const char *fmt, ...)
+{
+    _cleanup_free_ char *state = NULL;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = vasprintf(&state, fmt, ap);
+    va_end(ap);
+
+    if (rc < 0)
+        return -ENOMEM;
+    return notify(state);
+}
+
+uint64_t notify_watchdog_usec(void)
+{
+    const char *usec = getenv("WATCHDOG_USEC");
+    if (!usec || !usec[0])
+        return 0;
+
+    /* the watchdog may be meant for another process */
+    const char *pid = getenv("WATCHDOG_PID");
+    if (pid && pid[0] && strtol(pid, NULL, 10) != getpid())
+        return 0;
+
+    return strtoull(usec, NULL, 10);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+#include "util.h"
+
+int notify(const char *state);
+int notifyf(const char *fmt, ...) _printf_(1,2);
+
+uint64_t notify_watchdog_usec(void);
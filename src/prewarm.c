@@ -0,0 +1,244 @@
+#include "prewarm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xdg.h"
+#include "util.h"
+
+/* how many readaheads to keep in flight */
+#define PREWARM_THREADS 8
+/* resident runs closer than this get merged into one extent */
+#define PREWARM_GAP (256 << 10)
+/* extents are split into chunks this big so the threads share the work */
+#define PREWARM_CHUNK (2 << 20)
+
+/*
+ * The access profile is simply what was resident in the page cache some
+ * time after an earlier boot, as reported by mincore(2). It's stored as
+ * a list of extents, keyed by the image's device and inode, and only
+ * trusted while the image's size and mtime still match.
+ *
+ * A prewarmed boot has the whole profile resident whether the guest
+ * touched it or not, so only boots without one are worth recording.
+ */
+struct extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct extents {
+    struct extent *data;
+    size_t len;
+    size_t buflen;
+};
+
+struct prewarm {
+    int fd;
+    const struct extents *extents;
+    atomic_size_t next;
+};
+
+static int extents_push(struct extents *ex, uint64_t offset, uint64_t length)
+{
+    if (ex->len == ex->buflen) {
+        size_t newlen = ex->buflen ? ex->buflen * 2 : 64;
+        struct extent *data = realloc(ex->data, newlen * sizeof(struct extent));
+        if (!data)
+            return -errno;
+
+        ex->buflen = newlen;
+        ex->data = data;
+    }
+
+    ex->data[ex->len++] = (struct extent){ .offset = offset, .length = length };
+    return 0;
+}
+
+static char *profile_path(const struct stat *st)
+{
+    char *path = NULL;
+    asprintf(&path, "%s/qemu-monitor/prewarm-%" PRIx64 "-%" PRIx64, get_user_cache_dir(),
+             (uint64_t)st->st_dev, (uint64_t)st->st_ino);
+    return path;
+}
+
+static int load_profile(const struct stat *st, struct extents *ex)
+{
+    _cleanup_free_ char *path = profile_path(st);
+    _cleanup_fclose_ FILE *fp = fopen(path, "re");
+    if (!fp)
+        return -errno;
+
+    int64_t size, mtime;
+    if (fscanf(fp, "%" SCNd64 " %" SCNd64, &size, &mtime) != 2)
+        return -EINVAL;
+    if (size != st->st_size || mtime != st->st_mtime)
+        return -ESTALE;
+
+    uint64_t offset, length;
+    while (fscanf(fp, "%" SCNu64 " %" SCNu64, &offset, &length) == 2) {
+        while (length) {
+            uint64_t chunk = length < PREWARM_CHUNK ? length : PREWARM_CHUNK;
+            if (extents_push(ex, offset, chunk) < 0)
+                return -errno;
+
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+
+    return 0;
+}
+
+static void *prewarm_worker(void *arg)
+{
+    struct prewarm *pw = arg;
+    size_t idx;
+
+    while ((idx = atomic_fetch_add(&pw->next, 1)) < pw->extents->len) {
+        const struct extent *e = &pw->extents->data[idx];
+        readahead(pw->fd, e->offset, e->length);
+    }
+
+    return NULL;
+}
+
+int prewarm_image(const char *path)
+{
+    struct stat st;
+    struct extents ex = { 0 };
+
+    _cleanup_close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -errno;
+
+    int rc = load_profile(&st, &ex);
+    if (rc < 0) {
+        free(ex.data);
+        /* nothing recorded yet, or the image changed since */
+        return rc == -ENOENT || rc == -ESTALE ? 0 : rc;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct prewarm pw = { .fd = fd, .extents = &ex };
+    pthread_t threads[PREWARM_THREADS];
+    size_t idx, started = 0;
+
+    for (idx = 0; idx < PREWARM_THREADS; ++idx) {
+        if (pthread_create(&threads[idx], NULL, prewarm_worker, &pw) != 0)
+            break;
+        started++;
+    }
+
+    /* if no thread could be started, do the work ourselves */
+    if (!started)
+        prewarm_worker(&pw);
+    for (idx = 0; idx < started; ++idx)
+        pthread_join(threads[idx], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t total = 0;
+    for (idx = 0; idx < ex.len; ++idx)
+        total += ex.data[idx].length;
+
+    printf("prewarm: read %" PRIu64 " MiB of %s in %.2fs\n", total >> 20, path,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    fflush(stdout);
+
+    free(ex.data);
+    return 1;
+}
+
+static int write_profile(const struct stat *st, const unsigned char *vec, size_t pages, long pagesize)
+{
+    _cleanup_free_ char *path = profile_path(st);
+    _cleanup_free_ char *tmppath = NULL;
+    asprintf(&tmppath, "%s.tmp", path);
+
+    FILE *fp = fopen(tmppath, "we");
+    if (!fp)
+        return -errno;
+
+    fprintf(fp, "%" PRId64 " %" PRId64 "\n", (int64_t)st->st_size, (int64_t)st->st_mtime);
+
+    uint64_t start = 0, end = 0, total = 0;
+    size_t idx, extents = 0;
+
+    for (idx = 0; idx <= pages; ++idx) {
+        if (idx < pages && !(vec[idx] & 1))
+            continue;
+
+        uint64_t offset = (uint64_t)idx * pagesize;
+
+        /* extend the current run if the gap is small enough */
+        if (idx < pages && end && offset - end < PREWARM_GAP) {
+            end = offset + pagesize;
+            continue;
+        }
+
+        if (end) {
+            fprintf(fp, "%" PRIu64 " %" PRIu64 "\n", start, end - start);
+            total += end - start;
+            extents++;
+        }
+
+        start = offset;
+        end = offset + pagesize;
+    }
+
+    if (fclose(fp) != 0 || rename(tmppath, path) < 0) {
+        unlink(tmppath);
+        return -errno;
+    }
+
+    printf("prewarm: recorded %" PRIu64 " MiB in %zu extents\n", total >> 20, extents);
+    fflush(stdout);
+    return 0;
+}
+
+int prewarm_record(const char *path)
+{
+    struct stat st;
+
+    _cleanup_close_ int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -errno;
+    if (!st.st_size)
+        return 0;
+
+    _cleanup_free_ char *dir = NULL;
+    asprintf(&dir, "%s/qemu-monitor", get_user_cache_dir());
+    mkdir(get_user_cache_dir(), 0700);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -errno;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    const size_t pages = (st.st_size + pagesize - 1) / pagesize;
+
+    _cleanup_free_ unsigned char *vec = malloc(pages);
+    if (!vec || mincore(map, st.st_size, vec) < 0) {
+        munmap(map, st.st_size);
+        return -errno;
+    }
+
+    munmap(map, st.st_size);
+    return write_profile(&st, vec, pages, pagesize);
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+int prewarm_image(const char *path);
+int prewarm_record(const char *path);
@@ -2,50 +2,77 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <string.h>
 #include <errno.h>
 #include <err.h>
 #include <signal.h>
+#include <inttypes.h>
 #include <poll.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include "argbuilder.h"
+#include "caps.h"
 #include "config.h"
+#include "image.h"
+#include "iothrottle.h"
+#include "ksm.h"
+#include "notify.h"
+#include "prewarm.h"
 #include "qmp.h"
+#include "reconfig.h"
+#include "template.h"
 #include "xdg.h"
 
-struct qemu_config_t {
-    char *cpu;
-    char *smp;
-    char *memory;
-    char *memory_file;
-    char *disk;
-    char *disk_interface;
-    char *net_interface;
-    char *net_model;
-    char *net_macaddr;
-    char *rtc;
-    char *graphics;
-    char *soundhw;
-    char *serial;
-
-    bool fullscreen;
-    bool snapshot;
+#define QEMU_BINARY "qemu-system-x86_64"
+
+/* how often to check in on qemu when systemd isn't watching us */
+#define HEARTBEAT_USEC (5 * 1000000ULL)
+/* how often to sample block latency when throttling is enabled */
+#define IOTHROTTLE_USEC (2 * 1000000ULL)
+/* how long after boot the page cache reflects the vm's hot regions */
+#define PREWARM_RECORD_USEC (120 * 1000000ULL)
+/* how often to revisit the ksm scan rate */
+#define KSM_TUNE_USEC (10 * 1000000ULL)
+
+enum {
+    FD_SIGNAL,
+    FD_MONITOR,
+    FD_AGENT,
+    FD_HEARTBEAT,
+    FD_IOTHROTTLE,
+    FD_PREWARM,
+    FD_INOTIFY,
+    FD_KSM,
+    FD_COUNT
 };
 
 static sigset_t mask;
+static uint64_t watchdog_usec = 0;
+static pid_t qemu_pid = 0;
+static struct ksm_stat ksm_stat;
 
-static char *random_mac(void)
+/* the vm is only ready once its running, and the agent answered if asked */
+static bool vm_running = false;
+static bool vm_ready = false;
+static bool agent_required = false;
+static bool agent_alive = false;
+static bool nic_pending = false;
+
+static char *random_mac(struct qemu_config_t *config)
 {
-    char *macaddr;
     uint8_t addr[3];
 
     FILE *urandom = fopen("/dev/urandom", "r");
     fread(addr, sizeof(uint8_t), 3, urandom);
     fclose(urandom);
 
-    asprintf(&macaddr, "52:54:00:%02x:%02x:%02x",
-             addr[0], addr[1], addr[2]);
-    return macaddr;
+    return config_printf(config, "52:54:00:%02x:%02x:%02x",
+                         addr[0], addr[1], addr[2]);
 }
 
 static void make_sigset(sigset_t *set, ...)
@@ -61,107 +88,274 @@ static void make_sigset(sigset_t *set, ...)
     va_end(ap);
 }
 
-static void read_config(const char *config_file, struct qemu_config_t *config)
+static char *resolve_profile(const char *config_file)
 {
-    _cleanup_fclose_ FILE *fp = NULL;
+    char *profile = NULL;
 
     if (access(config_file, F_OK) < 0) {
         if (errno != ENOENT)
             err(1, "couldn't open %s", config_file);
 
-        _cleanup_free_ char *profile = NULL;
-
         asprintf(&profile, "%s/vm/%s.conf", get_user_config_dir(), config_file);
-        fp = fopen(profile, "r");
-        if (fp == NULL)
-            err(1, "couldn't open %s", profile);
     } else {
-        fp = fopen(config_file, "r");
-        if (fp == NULL)
-            err(1, "couldn't open %s", config_file);
+        profile = strdup(config_file);
     }
 
-    _cleanup_free_ char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+    return profile;
+}
 
-    while ((read = getline(&line, &len, fp)) != -1) {
-        _cleanup_free_ char *key = NULL, *value = NULL;
-        split_key_value(line, &key, &value);
+static void config_defaults(struct qemu_config_t *config, const char *config_file)
+{
+    size_t idx;
 
-        if (!key || !value)
-            continue;
+    /* if mac address isn't set, generate a random one */
+    for (idx = 0; idx < config->nics_len; ++idx) {
+        if (!config->nics[idx].macaddr)
+            config->nics[idx].macaddr = random_mac(config);
+    }
+
+    if (config->max_memory_size && config->max_memory_size <= config->memory_size)
+        errx(1, "MaxMemory must be set along with a smaller Memory");
+    if (config->ksm_max_pages && config->ksm_min_pages > config->ksm_max_pages)
+        errx(1, "KSMMinPagesToScan must not be larger than KSMMaxPagesToScan");
+
+    if (config->memory_merge == TRISTATE_YES && !ksm_running())
+        warnx("ksm isn't running on this host, MemoryMerge=yes won't share anything");
+
+    /* templates default to living alongside the user's data */
+    if (!config->template_dir) {
+        const char *name = basename(config_file);
+        size_t namelen = strlen(name);
+
+        if (namelen > 5 && streq(&name[namelen - 5], ".conf"))
+            namelen -= 5;
+        config->template_dir = config_printf(config, "%s/vm/%.*s.template",
+                                             get_user_data_dir(), (int)namelen, name);
+    }
+}
+
+static char *template_path(struct qemu_config_t *config, const char *name)
+{
+    char *path = NULL;
+    asprintf(&path, "%s/%s", config->template_dir, name);
+    return path;
+}
+
+static char *template_disk(struct qemu_config_t *config, size_t idx)
+{
+    char *path = NULL;
+
+    /* the first disk keeps the name it had before there could be several */
+    if (idx == 0)
+        asprintf(&path, "%s/disk.qcow2", config->template_dir);
+    else
+        asprintf(&path, "%s/disk%zu.qcow2", config->template_dir, idx);
+    return path;
+}
+
+static int make_overlay(struct qemu_config_t *config, size_t idx, const char *backing)
+{
+    struct disk_config *disk = &config->disks[idx];
+    const char *dir = config->snapshot_dir;
+
+    /* same default qemu itself uses for -snapshot */
+    if (!dir)
+        dir = getenv("TMPDIR");
+    if (!dir || !dir[0])
+        dir = "/var/tmp";
+
+    char *overlay = config_printf(config, "%s/overlay-%d-%zu.qcow2", dir, getpid(), idx);
+    int rc = image_create_overlay(backing, overlay, config->cluster_size);
+    if (rc < 0)
+        return rc;
+
+    disk->overlay = overlay;
+    disk->backing = config_strdup(config, backing);
+    disk->path = disk->overlay;
+    return 0;
+}
 
-        if (streq(key, "CPU")) {
-            config->cpu = strdup(value);
-        } else if (streq(key, "SMP")) {
-            config->smp = strdup(value);
-        } else if (streq(key, "Memory")) {
-            config->memory = strdup(value);
-        } else if (streq(key, "MemoryFile")) {
-            config->memory_file = strdup(value);
-        } else if (streq(key, "Disk")) {
-            config->disk = strdup(value);
-        } else if (streq(key, "DiskInterface")) {
-            config->disk_interface = strdup(value);
-        } else if (streq(key, "NetInterface")) {
-            config->net_interface = strdup(value);
-        } else if (streq(key, "NetModel")) {
-            config->net_model = strdup(value);
-        } else if (streq(key, "NetMacAddress")) {
-            config->net_macaddr = strdup(value);
-        } else if (streq(key, "RealTimeClock")) {
-            config->rtc = strdup(value);
-        } else if (streq(key, "Graphics")) {
-            config->graphics = strdup(value);
-        } else if (streq(key, "SoundHardware")) {
-            config->soundhw = strdup(value);
-        } else if (streq(key, "SerialPort")) {
-            config->serial = strdup(value);
+static bool snapshot_overlays(const struct qemu_config_t *config)
+{
+    if (!config->disks_len)
+        return false;
+    for (size_t idx = 0; idx < config->disks_len; ++idx) {
+        if (!config->disks[idx].overlay)
+            return false;
+    }
+    return true;
+}
+
+static void prepare_template(struct qemu_config_t *config)
+{
+    if (!config->memory_size)
+        errx(1, "templates need Memory= set");
+
+    size_t idx;
+
+    if (config->template) {
+        _cleanup_free_ char *vmdir = NULL;
+        asprintf(&vmdir, "%s/vm", get_user_data_dir());
+        mkdir(vmdir, 0755);
+
+        if (mkdir(config->template_dir, 0755) < 0 && errno != EEXIST)
+            err(1, "failed to create %s", config->template_dir);
+
+        /* start over: the ram file and state have to be from the same boot */
+        _cleanup_free_ char *rampath = template_path(config, "ram");
+        _cleanup_free_ char *statepath = template_path(config, "state");
+        unlink(rampath);
+        unlink(statepath);
+
+        /* keep the base images pristine, the template boots from its own layers */
+        for (idx = 0; idx < config->disks_len; ++idx) {
+            _cleanup_free_ char *diskpath = template_disk(config, idx);
+
+            /* running clones still read the old one, it can't be rewritten in place */
+            unlink(diskpath);
+            if (image_create_overlay(config->disks[idx].path, diskpath, 0) < 0)
+                errx(1, "failed to create template disk %s", diskpath);
+            config->disks[idx].path = config_strdup(config, diskpath);
+        }
+    } else {
+        _cleanup_free_ char *statepath = template_path(config, "state");
+        if (access(statepath, R_OK) < 0)
+            err(1, "no template saved in %s, boot one with --template first", config->template_dir);
+
+        for (idx = 0; idx < config->disks_len; ++idx) {
+            _cleanup_free_ char *diskpath = template_disk(config, idx);
+            if (make_overlay(config, idx, diskpath) < 0)
+                errx(1, "failed to create overlay for %s", diskpath);
         }
 
+        /* every clone needs its own identity on the network */
+        for (idx = 0; idx < config->nics_len; ++idx)
+            config->nics[idx].macaddr = random_mac(config);
+        nic_pending = config->nics_len > 0;
     }
+}
 
-    /* if mac address isn't set, generate a random one */
-    if (!config->net_macaddr)
-        config->net_macaddr = random_mac();
+static char *agent_sockpath(void)
+{
+    char *socket = NULL;
+    asprintf(&socket, "%s/guest-agent-%d", get_user_runtime_dir(), getpid());
+    return socket;
 }
 
-static void launch_qemu(struct qemu_config_t *config, const char *sockpath)
+static void launch_qemu(struct qemu_config_t *config, const char *sockpath,
+                        const char *agentpath)
 {
     char **argv;
     args_t buf;
+    size_t idx;
 
     args_init(&buf, 32);
-    args_append(&buf, "qemu-system-x86_64", "-enable-kvm", NULL);
+    args_append(&buf, QEMU_BINARY, "-enable-kvm", NULL);
+
+    /* left out, qemu marks guest ram mergeable as long as ksm is built in */
+    const char *merge = NULL;
+    if (config->memory_merge != TRISTATE_DEFAULT)
+        merge = config->memory_merge == TRISTATE_YES ? "on" : "off";
+
+    _cleanup_free_ char *machine = NULL;
+    asprintf(&machine, "%s%s%s%s%s",
+             config->machine ? ",type=" : "",
+             config->machine ? config->machine : "",
+             config->template || config->clone ? ",memory-backend=ram0" : "",
+             merge ? ",mem-merge=" : "",
+             merge ? merge : "");
+
+    /* skip the separator in front of the first option */
+    if (machine[0]) {
+        args_printf(&buf, "-machine");
+        args_printf(&buf, "%s", machine + 1);
+    }
 
     if (config->cpu)
         args_append(&buf, "-cpu", config->cpu, NULL);
     if (config->smp)
         args_append(&buf, "-smp", config->smp, NULL);
-    if (config->memory)
-        args_append(&buf, "-m", config->memory, NULL);
-    if (config->memory_file)
+    if (config->memory_size && config->max_memory_size) {
+        args_printf(&buf, "-m");
+        args_printf(&buf, "%" PRIu64 "M,maxmem=%" PRIu64 "M",
+                    config->memory_size >> 20, config->max_memory_size >> 20);
+    } else if (config->memory_size) {
+        args_printf(&buf, "-m");
+        args_printf(&buf, "%" PRIu64 "M", config->memory_size >> 20);
+    }
+
+    if (config->template || config->clone) {
+        _cleanup_free_ char *rampath = template_path(config, "ram");
+
+        /* clones map the template's ram privately: copy-on-write */
+        args_printf(&buf, "-object");
+        args_printf(&buf, "memory-backend-file,id=ram0,size=%" PRIu64 ",mem-path=%s,share=%s%s%s",
+                    config->memory_size, rampath, config->template ? "on" : "off",
+                    merge ? ",merge=" : "", merge ? merge : "");
+    } else if (config->memory_file) {
         args_append(&buf, "-mem-path", config->memory_file, NULL);
+    }
+
     if (config->serial)
         args_append(&buf, "-serial", config->serial, NULL);
 
-    if (config->disk) {
-        args_printf(&buf, "-drive");
-        if (config->disk_interface)
-            args_printf(&buf, "file=%s,if=%s,index=0,media=disk,cache=none", config->disk, config->disk_interface);
-        else
-            args_printf(&buf, "file=%s,index=0,media=disk,cache=none", config->disk);
+    /* memory beyond the boot size is handed out live through virtio-mem */
+    if (config->max_memory_size) {
+        args_printf(&buf, "-object");
+        args_printf(&buf, "memory-backend-ram,id=vmem0,size=%" PRIu64 "%s%s",
+                    config->max_memory_size - config->memory_size,
+                    merge ? ",merge=" : "", merge ? merge : "");
+        args_append(&buf, "-device", "virtio-mem-pci,id=vmem0-dev,memdev=vmem0,requested-size=0", NULL);
     }
 
-    if (config->net_interface) {
-        args_printf(&buf, "-net");
-        args_printf(&buf, "tap,ifname=%s,script=no,downscript=no", config->net_interface);
+    for (idx = 0; idx < config->disks_len; ++idx) {
+        const struct disk_config *disk = &config->disks[idx];
+        _cleanup_free_ char *extra = NULL;
+
+        /*
+         * overlays often sit on tmpfs, which only takes O_DIRECT since 6.6,
+         * so only their backing image bypasses the page cache - and not even
+         * that when prewarming, which only helps through the page cache
+         */
+        const char *cache = disk->overlay ? "writeback" : "none";
+        /* qemu refuses native aio without O_DIRECT */
+        const char *aio = config->disk_aio;
+        if (disk->overlay && aio && streq(aio, "native"))
+            aio = NULL;
+
+        asprintf(&extra, "%s%s%s%s",
+                 disk->overlay && !config->prewarm ? ",backing.cache.direct=on" : "",
+                 aio ? ",aio=" : "",
+                 aio ? aio : "",
+                 disk->readonly ? ",readonly=on" : "");
+
+        args_printf(&buf, "-drive");
+        /* virtio disks get their own device so they can be swapped live */
+        if (disk->interface && streq(disk->interface, "virtio")) {
+            args_printf(&buf, "file=%s,if=none,id=disk%zu,media=disk,cache=%s%s", disk->path, idx, cache, extra);
+            args_printf(&buf, "-device");
+            args_printf(&buf, "virtio-blk-pci,drive=disk%zu,id=disk%zu-dev", idx, idx);
+        } else if (disk->interface) {
+            args_printf(&buf, "file=%s,if=%s,id=disk%zu,index=%zu,media=disk,cache=%s%s",
+                        disk->path, disk->interface, idx, idx, cache, extra);
+        } else {
+            args_printf(&buf, "file=%s,id=disk%zu,index=%zu,media=disk,cache=%s%s", disk->path, idx, idx, cache, extra);
+        }
     }
 
-    if (config->net_model) {
-        args_printf(&buf, "-net");
-        args_printf(&buf, "nic,model=%s,macaddr=%s", config->net_model, config->net_macaddr);
+    /* templates boot without nics, clones get theirs hotplugged */
+    for (idx = 0; !config->template && !config->clone && idx < config->nics_len; ++idx) {
+        const struct nic_config *nic = &config->nics[idx];
+
+        args_printf(&buf, "-netdev");
+        if (nic->interface)
+            args_printf(&buf, "tap,id=net%zu,ifname=%s,script=no,downscript=no%s",
+                        idx, nic->interface, nic->vhost ? ",vhost=on" : "");
+        else
+            args_printf(&buf, "user,id=net%zu", idx);
+
+        args_printf(&buf, "-device");
+        args_printf(&buf, "%s,netdev=net%zu,id=nic%zu,mac=%s", nic_driver(nic->model), idx, idx, nic->macaddr);
     }
 
     if (config->rtc) {
@@ -180,8 +374,17 @@ static void launch_qemu(struct qemu_config_t *config, const char *sockpath)
         args_append(&buf, "-soundhw", config->soundhw, NULL);
     if (config->fullscreen)
         args_append(&buf, "-full-screen", NULL);
-    if (config->snapshot)
+    if (config->snapshot && !snapshot_overlays(config))
         args_append(&buf, "-snapshot", NULL);
+    if (config->clone)
+        args_append(&buf, "-incoming", "defer", NULL);
+
+    if (agentpath) {
+        args_printf(&buf, "-chardev");
+        args_printf(&buf, "socket,id=agent0,path=%s", agentpath);
+        args_append(&buf, "-device", "virtio-serial",
+                    "-device", "virtserialport,chardev=agent0,name=org.qemu.guest_agent.0", NULL);
+    }
 
     args_append(&buf, "-monitor", "none", "-qmp", NULL);
     args_printf(&buf, "unix:%s", sockpath);
@@ -191,7 +394,8 @@ static void launch_qemu(struct qemu_config_t *config, const char *sockpath)
     err(1, "failed to exec %s", argv[0]);
 }
 
-static pid_t fork_qemu(struct qemu_config_t *config, const char *sockpath)
+static pid_t fork_qemu(struct qemu_config_t *config, const char *sockpath,
+                       const char *agentpath)
 {
     pid_t pid = fork();
     if (pid < 0) {
@@ -200,7 +404,11 @@ static pid_t fork_qemu(struct qemu_config_t *config, const char *sockpath)
         setsid();
         if (sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0)
             err(1, "failed to set sigprocmask");
-        launch_qemu(config, sockpath);
+
+        /* qemu madvises guest ram for huge pages itself, disabling them here survives exec */
+        if (config->disable_hugepages && prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) < 0)
+            warn("failed to disable transparent huge pages");
+        launch_qemu(config, sockpath, agentpath);
     }
 
     return pid;
@@ -212,35 +420,458 @@ static _noreturn_ void usage(FILE *out)
     fputs("Options:\n"
         " -h, --help            display this help\n"
         " -f, --fullscreen      start the vm in fullscreen mode (if graphical)\n"
-        " -s, --snapshot        write to temporary files instead of the disk image file\n", out);
+        " -s, --snapshot        write to temporary files instead of the disk image file\n"
+        " -t, --template        boot the template vm, save it on SIGUSR1\n"
+        " -c, --clone           resume a disposable clone of the saved template\n", out);
 
     exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-static int loop(int qmp_fd)
+static int make_timer(uint64_t usec, bool repeat)
+{
+    const struct timespec ts = {
+        .tv_sec = usec / 1000000,
+        .tv_nsec = (usec % 1000000) * 1000
+    };
+    const struct itimerspec its = {
+        .it_interval = repeat ? ts : (struct timespec){ 0 },
+        .it_value = ts
+    };
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0)
+        err(1, "failed to create timerfd");
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+        err(1, "failed to arm timerfd");
+    return fd;
+}
+
+static void notify_running(void)
+{
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    const uint64_t shared = ksm_stat.merging_pages * pagesize;
+
+    if (!shared)
+        notify("STATUS=VM running");
+    else if (ksm_stat.has_profit)
+        notifyf("STATUS=VM running, ksm sharing %" PRIu64 " MiB, saving %" PRId64 " MiB",
+                shared >> 20, ksm_stat.profit / (1 << 20));
+    else
+        notifyf("STATUS=VM running, ksm sharing %" PRIu64 " MiB", shared >> 20);
+}
+
+static void check_ready(void)
+{
+    if (vm_ready || !vm_running || nic_pending)
+        return;
+
+    if (agent_required && !agent_alive) {
+        notify("STATUS=VM running, waiting for guest agent");
+        return;
+    }
+
+    vm_ready = true;
+    notify("READY=1\nSTATUS=VM running");
+}
+
+static void handle_event(const char *event, json_t *data)
+{
+    (void)data;
+
+    if (streq(event, "RESUME")) {
+        vm_running = true;
+        if (vm_ready)
+            notify_running();
+        check_ready();
+    } else if (streq(event, "STOP")) {
+        vm_running = false;
+        notify("STATUS=VM paused");
+    } else if (streq(event, "RESET")) {
+        notify("STATUS=VM reset");
+    } else if (streq(event, "POWERDOWN")) {
+        notify("STATUS=VM powering down");
+    } else if (streq(event, "SHUTDOWN")) {
+        notify("STATUS=VM shut down");
+    }
+}
+
+static void save_template(int cfd, struct qemu_config_t *config)
+{
+    _cleanup_free_ char *statepath = template_path(config, "state");
+
+    printf("Saving template to %s...\n", config->template_dir);
+    fflush(stdout);
+    notify("STATUS=Saving template");
+
+    if (template_save(cfd, statepath) < 0) {
+        warnx("failed to save template, resuming vm");
+        unlink(statepath);
+        qmp_command(cfd, "cont");
+        return;
+    }
+
+    notify("STOPPING=1\nSTATUS=Template saved");
+    qmp_command(cfd, "quit");
+}
+
+static void heartbeat(int cfd, int afd)
+{
+    _cleanup_json_ json_t *status = qmp_execute(cfd, "query-status", NULL);
+    if (!status) {
+        notify("STATUS=VM not responding");
+        return;
+    }
+
+    /* only pet the watchdog while qemu actually answers */
+    if (watchdog_usec)
+        notify("WATCHDOG=1");
+
+    /* the agent only answers once the guest has started it */
+    if (afd >= 0 && !agent_alive)
+        qmp_send(afd, "guest-ping", NULL);
+
+    struct ksm_stat stat;
+    if (vm_ready && vm_running && ksm_read_stat(qemu_pid, &stat) == 0 &&
+        stat.merging_pages != ksm_stat.merging_pages) {
+        ksm_stat = stat;
+        notify_running();
+    }
+}
+
+static void handle_agent(struct pollfd *pfd, bool listening)
+{
+    if (listening) {
+        int afd = accept4(pfd->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (afd < 0)
+            err(EXIT_FAILURE, "failed to accept guest agent connection");
+
+        close(pfd->fd);
+        pfd->fd = afd;
+        qmp_send(afd, "guest-ping", NULL);
+        return;
+    }
+
+    _cleanup_json_ json_t *reply = qmp_recv(pfd->fd);
+    if (!reply) {
+        qmp_close(pfd->fd);
+        pfd->fd = -1;
+        return;
+    }
+
+    if (!agent_alive && json_object_get(reply, "return")) {
+        agent_alive = true;
+        check_ready();
+    }
+}
+
+static int watch_profile(const char *profile)
+{
+    _cleanup_free_ char *dir = strdup(profile);
+    char *slash = strrchr(dir, '/');
+
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    /* editors tend to replace files, so watch the directory instead */
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        warn("failed to watch %s, live reconfiguration disabled", profile);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool profile_changed(int fd, const char *name)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+
+        const struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)ptr;
+            if (event->len && streq(event->name, name))
+                changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/* what the profile doesn't say about the running vm, assume hasn't changed */
+static void inherit_macs(struct qemu_config_t *profile, const struct qemu_config_t *running)
+{
+    size_t idx;
+
+    for (idx = 0; idx < profile->nics_len && idx < running->nics_len; ++idx) {
+        if (!profile->nics[idx].macaddr && running->nics[idx].macaddr)
+            profile->nics[idx].macaddr = config_strdup(profile, running->nics[idx].macaddr);
+    }
+}
+
+static void throttle_disks(struct iothrottle io[], const struct reconfig *rc, uint64_t target_usec)
+{
+    size_t idx;
+
+    for (idx = 0; idx < CONFIG_MAX_DISKS; ++idx) {
+        if (!rc->disk_ids[idx][0] || io[idx].statpath)
+            continue;
+
+        /* qemu is already running, losing the throttle beats leaving it unmanaged */
+        int ret = iothrottle_init(&io[idx], rc->disk_ids[idx], target_usec);
+        if (ret < 0) {
+            warnx("io: can't share stats in /run/qemu-monitor/iostat, not throttling: %s", strerror(-ret));
+            break;
+        }
+    }
+}
+
+static void reload_profile(const char *path, struct qemu_config_t *profile, json_t *caps,
+                           struct reconfig *rc, struct iothrottle io[],
+                           struct pollfd fds[], int cfd)
+{
+    struct qemu_config_t next = { 0 };
+    char disk_ids[CONFIG_MAX_DISKS][sizeof(rc->disk_ids[0])];
+    size_t idx;
+
+    if (config_read(path, &next) < 0) {
+        config_free(&next);
+        return;
+    }
+
+    /* an unset mac is randomly generated, don't count that as a change */
+    inherit_macs(&next, profile);
+    for (idx = 0; idx < next.nics_len; ++idx) {
+        if (!next.nics[idx].macaddr)
+            next.nics[idx].macaddr = random_mac(&next);
+    }
+
+    /* hotplugged disks and nics get the same backends as the ones qemu started with */
+    if (caps)
+        caps_pick_backends(caps, &next);
+
+    printf("reconfig: %s changed, applying\n", path);
+    fflush(stdout);
+
+    memcpy(disk_ids, rc->disk_ids, sizeof(disk_ids));
+    reconfig_apply(rc, cfd, profile, &next);
+    for (idx = 0; idx < CONFIG_MAX_DISKS; ++idx) {
+        if (!streq(disk_ids[idx], rc->disk_ids[idx]))
+            iothrottle_reset(&io[idx]);
+    }
+
+    if (next.io_latency_target)
+        throttle_disks(io, rc, next.io_latency_target);
+
+    if (next.io_latency_target != profile->io_latency_target) {
+        for (idx = 0; idx < CONFIG_MAX_DISKS; ++idx)
+            iothrottle_set_target(&io[idx], cfd, next.io_latency_target);
+
+        if (next.io_latency_target && fds[FD_IOTHROTTLE].fd < 0) {
+            fds[FD_IOTHROTTLE].fd = make_timer(IOTHROTTLE_USEC, true);
+        } else if (!next.io_latency_target && fds[FD_IOTHROTTLE].fd >= 0) {
+            close(fds[FD_IOTHROTTLE].fd);
+            fds[FD_IOTHROTTLE].fd = -1;
+        }
+
+        printf("reconfig: io latency target now %.2fms\n", next.io_latency_target / 1e3);
+        fflush(stdout);
+    }
+
+    if (next.ksm_min_pages != profile->ksm_min_pages || next.ksm_max_pages != profile->ksm_max_pages) {
+        if (next.ksm_max_pages && fds[FD_KSM].fd < 0) {
+            fds[FD_KSM].fd = make_timer(KSM_TUNE_USEC, true);
+        } else if (!next.ksm_max_pages && fds[FD_KSM].fd >= 0) {
+            close(fds[FD_KSM].fd);
+            fds[FD_KSM].fd = -1;
+        }
+
+        if (next.ksm_max_pages)
+            printf("reconfig: ksm scanning %" PRIu64 "-%" PRIu64 " pages at a time\n",
+                   next.ksm_min_pages, next.ksm_max_pages);
+        else
+            printf("reconfig: ksm scan rate left alone\n");
+        fflush(stdout);
+    }
+
+    config_free(profile);
+    *profile = next;
+}
+
+static void free_throttles(struct iothrottle io[])
+{
+    size_t idx;
+
+    for (idx = 0; idx < CONFIG_MAX_DISKS; ++idx)
+        iothrottle_free(&io[idx]);
+}
+
+static int loop(struct qemu_config_t *config, struct qemu_config_t *profile, json_t *caps,
+                const char *profile_path, int qmp_fd, int agent_fd)
 {
     _cleanup_close_ int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
     _cleanup_close_ int cfd = qmp_accept(qmp_fd);
+    _cleanup_close_ int tfd = make_timer(watchdog_usec ? watchdog_usec / 2 : HEARTBEAT_USEC, true);
+    _cleanup_close_ int pwfd = -1;
+    _cleanup_close_ int ifd = watch_profile(profile_path);
+    int iofd = -1, ksmfd = -1;
     if (sfd < 0)
         err(1, "failed to create signalfd");
 
-    struct pollfd fds[] = {
-        { .fd = sfd, .events = POLLIN }
+    size_t idx;
+
+    struct reconfig reconfig;
+    reconfig_init(&reconfig, config);
+
+    inherit_macs(profile, config);
+
+    struct iothrottle io[CONFIG_MAX_DISKS] = { 0 };
+    if (config->io_latency_target && config->disks_len) {
+        throttle_disks(io, &reconfig, config->io_latency_target);
+        iofd = make_timer(IOTHROTTLE_USEC, true);
+    }
+
+    for (idx = 0; idx < config->disks_len; ++idx) {
+        const struct disk_config *disk = &config->disks[idx];
+        if (config->prewarm && disk->backing && !disk->prewarmed && pwfd < 0)
+            pwfd = make_timer(PREWARM_RECORD_USEC, false);
+    }
+
+    if (config->ksm_max_pages)
+        ksmfd = make_timer(KSM_TUNE_USEC, true);
+
+    bool agent_listening = true;
+    struct pollfd fds[FD_COUNT] = {
+        [FD_SIGNAL]     = { .fd = sfd,      .events = POLLIN },
+        [FD_MONITOR]    = { .fd = cfd,      .events = POLLIN },
+        [FD_AGENT]      = { .fd = agent_fd, .events = POLLIN },
+        [FD_HEARTBEAT]  = { .fd = tfd,      .events = POLLIN },
+        [FD_IOTHROTTLE] = { .fd = iofd,     .events = POLLIN },
+        [FD_PREWARM]    = { .fd = pwfd,     .events = POLLIN },
+        [FD_INOTIFY]    = { .fd = ifd,      .events = POLLIN },
+        [FD_KSM]        = { .fd = ksmfd,    .events = POLLIN }
     };
-    const size_t fd_count = sizeof(fds) / sizeof(fds[0]);
+
+    qmp_set_event_handler(handle_event);
+
+    _cleanup_json_ json_t *status = qmp_execute(cfd, "query-status", NULL);
+    vm_running = json_is_true(json_object_get(status, "running"));
+    check_ready();
+
+    /* qemu holds the overlays open now, they can go whenever qemu does */
+    for (idx = 0; idx < config->disks_len; ++idx) {
+        if (config->disks[idx].overlay)
+            unlink(config->disks[idx].overlay);
+    }
+
+    if (config->clone) {
+        _cleanup_free_ char *statepath = template_path(config, "state");
+
+        notify("STATUS=Restoring template");
+        if (template_restore(cfd, statepath) < 0)
+            errx(1, "failed to restore template from %s", config->template_dir);
+    }
 
     while (true) {
-        int ret = poll(fds, fd_count, -1);
+        /* events read while waiting on a reply are buffered, poll won't see them */
+        bool pending = fds[FD_MONITOR].fd >= 0 && qmp_pending(cfd);
+        /* a clone resumed by template_restore has its nics to plug right away */
+        bool plug = nic_pending && vm_running && fds[FD_MONITOR].fd >= 0;
+        int ret = poll(fds, FD_COUNT, pending || plug ? 0 : -1);
 
-        if (ret == 0) {
-            continue;
-        } else if (ret < 0) {
+        if (ret < 0) {
             if (errno == EINTR)
                 continue;
             err(EXIT_FAILURE, "failed to poll");
         }
 
-        if (!(fds[0].revents & POLLIN))
+        if (pending || fds[FD_MONITOR].revents & (POLLIN | POLLHUP)) {
+            _cleanup_json_ json_t *message = qmp_recv(cfd);
+            if (message)
+                qmp_dispatch(message);
+            else if (errno != EAGAIN)
+                fds[FD_MONITOR].fd = -1;
+        }
+
+        /* once qemu hangs up, all that's left is reaping it */
+        const bool monitor = fds[FD_MONITOR].fd >= 0;
+
+        if (fds[FD_AGENT].revents & (POLLIN | POLLHUP)) {
+            handle_agent(&fds[FD_AGENT], agent_listening);
+            agent_listening = false;
+        }
+
+        if (fds[FD_HEARTBEAT].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(tfd, &expirations, sizeof(expirations)) < 0)
+                err(EXIT_FAILURE, "failed to read timer");
+            if (monitor)
+                heartbeat(cfd, agent_listening ? -1 : fds[FD_AGENT].fd);
+        }
+
+        if (fds[FD_IOTHROTTLE].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(fds[FD_IOTHROTTLE].fd, &expirations, sizeof(expirations)) < 0)
+                err(EXIT_FAILURE, "failed to read timer");
+            for (idx = 0; monitor && idx < CONFIG_MAX_DISKS; ++idx) {
+                if (io[idx].statpath)
+                    iothrottle_sample(&io[idx], cfd);
+            }
+        }
+
+        if (fds[FD_PREWARM].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(pwfd, &expirations, sizeof(expirations)) < 0)
+                err(EXIT_FAILURE, "failed to read timer");
+            for (idx = 0; idx < config->disks_len; ++idx) {
+                const char *backing = config->disks[idx].backing;
+                if (!backing || config->disks[idx].prewarmed)
+                    continue;
+
+                int rc = prewarm_record(backing);
+                if (rc < 0)
+                    warnx("failed to record access profile of %s: %s", backing, strerror(-rc));
+            }
+            fds[FD_PREWARM].fd = -1;
+        }
+
+        if (fds[FD_INOTIFY].revents & POLLIN && profile_changed(ifd, basename(profile_path)) && monitor)
+            reload_profile(profile_path, profile, caps, &reconfig, io, fds, cfd);
+
+        if (fds[FD_KSM].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(fds[FD_KSM].fd, &expirations, sizeof(expirations)) < 0)
+                err(EXIT_FAILURE, "failed to read timer");
+
+            int rc = ksm_tune(profile->ksm_min_pages, profile->ksm_max_pages);
+            if (rc < 0) {
+                warnx("failed to tune ksm, giving up: %s", strerror(-rc));
+                close(fds[FD_KSM].fd);
+                fds[FD_KSM].fd = -1;
+            }
+        }
+
+        if (nic_pending && vm_running && monitor) {
+            for (idx = 0; idx < config->nics_len; ++idx) {
+                if (reconfig_plug_nic(&reconfig, cfd, idx, &config->nics[idx]) < 0)
+                    warnx("failed to attach %s to clone", reconfig.nic_ids[idx]);
+            }
+            nic_pending = false;
+            check_ready();
+        }
+
+        if (!(fds[FD_SIGNAL].revents & POLLIN))
             continue;
 
         struct signalfd_siginfo si;
@@ -254,16 +885,23 @@ static int loop(int qmp_fd)
         case SIGTERM:
             printf("Sending ACPI halt signal to vm...\n");
             fflush(stdout);
+            notify("STOPPING=1\nSTATUS=Sending ACPI halt signal to vm");
             qmp_command(cfd, "system_powerdown");
             break;
+        case SIGUSR1:
+            if (config->template)
+                save_template(cfd, config);
+            break;
         case SIGCHLD:
             switch (si.ssi_code) {
             case CLD_EXITED:
+                free_throttles(io);
                 if (si.ssi_status)
                     warnx("application terminated with error code %d", si.ssi_status);
                 return si.ssi_status;
             case CLD_KILLED:
             case CLD_DUMPED:
+                free_throttles(io);
                 errx(1, "application terminated abnormally with signal %d (%s)",
                      si.ssi_status, strsignal(si.ssi_status));
             case CLD_TRAPPED:
@@ -271,6 +909,7 @@ static int loop(int qmp_fd)
             default:
                 break;
             }
+            free_throttles(io);
             return 0;
         }
     }
@@ -282,16 +921,20 @@ int main(int argc, char *argv[])
         { "help",       no_argument, 0, 'h' },
         { "fullscreen", no_argument, 0, 'f' },
         { "snapshot",   no_argument, 0, 's' },
+        { "template",   no_argument, 0, 't' },
+        { "clone",      no_argument, 0, 'c' },
         { 0, 0, 0, 0 }
     };
 
     struct qemu_config_t config = {
         .fullscreen = false,
-        .snapshot = false
+        .snapshot = false,
+        .template = false,
+        .clone = false
     };
 
     for (;;) {
-        int opt = getopt_long(argc, argv, "hfs", opts, NULL);
+        int opt = getopt_long(argc, argv, "hfstc", opts, NULL);
         if (opt == -1)
             break;
 
@@ -305,6 +948,12 @@ int main(int argc, char *argv[])
         case 's':
             config.snapshot = true;
             break;
+        case 't':
+            config.template = true;
+            break;
+        case 'c':
+            config.clone = true;
+            break;
         default:
             usage(stderr);
         }
@@ -316,13 +965,69 @@ int main(int argc, char *argv[])
     const char *config_file = argv[optind];
     if (!config_file)
         errx(1, "config not set");
-    read_config(config_file, &config);
+    _cleanup_free_ char *profile_path = resolve_profile(config_file);
+    if (config_read(profile_path, &config) < 0)
+        exit(1);
+
+    /* what the profile said last, as opposed to what qemu was started with */
+    struct qemu_config_t profile;
+    config_copy(&profile, &config);
+    config_defaults(&config, config_file);
+
+    /* catch what this qemu can't do before it's started, not after */
+    _cleanup_json_ json_t *caps = caps_load(QEMU_BINARY);
+    if (caps) {
+        if (caps_check_config(caps, &config) < 0)
+            errx(1, "%s asks for things this qemu doesn't support", profile_path);
+        caps_pick_backends(caps, &config);
+    } else {
+        warnx("couldn't probe %s, starting it unchecked", QEMU_BINARY);
+    }
+
+    if (config.template && config.clone)
+        errx(1, "--template and --clone are mutually exclusive");
+    if (config.template || config.clone)
+        prepare_template(&config);
+    else if (config.snapshot) {
+        for (size_t idx = 0; idx < config.disks_len; ++idx) {
+            int rc = make_overlay(&config, idx, config.disks[idx].path);
+            if (rc == -ENOENT) {
+                /* launch_qemu passes -snapshot for any disk left without an overlay */
+                warnx("qemu-img not found, falling back to -snapshot");
+                break;
+            } else if (rc < 0) {
+                errx(1, "failed to create overlay for %s: %s", config.disks[idx].path, strerror(-rc));
+            }
+        }
+    }
+
+    for (size_t idx = 0; config.prewarm && idx < config.disks_len; ++idx) {
+        const char *backing = config.disks[idx].backing;
+        if (!backing)
+            continue;
+
+        int rc = prewarm_image(backing);
+        if (rc < 0)
+            warnx("failed to prewarm %s: %s", backing, strerror(-rc));
+        config.disks[idx].prewarmed = rc > 0;
+    }
+
+    _cleanup_free_ char *agentpath = NULL;
+    int agent_fd = -1;
+    if (config.guest_agent) {
+        agentpath = agent_sockpath();
+        agent_fd = qmp_listen(agentpath);
+        agent_required = true;
+    }
+
+    watchdog_usec = notify_watchdog_usec();
 
-    make_sigset(&mask, SIGCHLD, SIGTERM, SIGINT, 0);
+    make_sigset(&mask, SIGCHLD, SIGTERM, SIGINT, SIGUSR1, 0);
 
     if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
         err(1, "failed to set sigprocmask");
 
-    fork_qemu(&config, sockpath);
-    return loop(qmp_fd);
+    notify("STATUS=Starting VM");
+    qemu_pid = fork_qemu(&config, sockpath, agentpath);
+    return loop(&config, &profile, caps, profile_path, qmp_fd, agent_fd);
 }
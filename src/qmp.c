@@ -1,13 +1,72 @@
 #include "qmp.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <err.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <linux/un.h>
 #include <jansson.h>
 
 #include "xdg.h"
 #include "util.h"
 
+/* how long to wait on qemu before giving up on a reply */
+#define QMP_TIMEOUT 5
+/* the monitor, the guest agent, and a capability probe */
+#define QMP_MAX_CONNECTIONS 4
+
+/*
+ * Every message ends in a newline. Reads go through a buffer per
+ * connection so the trailing newline never lingers in the socket, and
+ * several messages arriving at once are handed out one at a time.
+ */
+struct qmp_buffer {
+    int fd;
+    char *data;
+    size_t len;
+    size_t buflen;
+};
+
+static qmp_event_fn event_handler = NULL;
+static json_int_t next_id = 0;
+static struct qmp_buffer buffers[QMP_MAX_CONNECTIONS] = {
+    { .fd = -1 }, { .fd = -1 }, { .fd = -1 }, { .fd = -1 }
+};
+
+static struct qmp_buffer *find_buffer(int fd)
+{
+    struct qmp_buffer *unused = NULL;
+    size_t idx;
+
+    for (idx = 0; idx < QMP_MAX_CONNECTIONS; ++idx) {
+        if (buffers[idx].fd == fd)
+            return &buffers[idx];
+        if (buffers[idx].fd < 0 && !unused)
+            unused = &buffers[idx];
+    }
+
+    if (!unused)
+        errx(EXIT_FAILURE, "too many monitor connections");
+
+    unused->fd = fd;
+    unused->len = 0;
+    return unused;
+}
+
+static void drop_buffer(int fd)
+{
+    size_t idx;
+
+    for (idx = 0; idx < QMP_MAX_CONNECTIONS; ++idx) {
+        if (buffers[idx].fd == fd) {
+            free(buffers[idx].data);
+            buffers[idx] = (struct qmp_buffer){ .fd = -1 };
+        }
+    }
+}
+
 char *qmp_sockpath(void)
 {
     char *socket = NULL;
@@ -43,50 +102,174 @@ int qmp_accept(int fd)
     int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
     if (cfd < 0)
         err(EXIT_FAILURE, "failed to accept connection");
+    drop_buffer(cfd);
 
-    char buf[BUFSIZ];
-    read(cfd, buf, sizeof(buf));
+    /* a hung qemu shouldn't hang us too */
+    struct timeval tv = { .tv_sec = QMP_TIMEOUT };
+    if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        err(EXIT_FAILURE, "failed to set monitor timeout");
+
+    _cleanup_json_ json_t *greeting = qmp_recv(cfd);
     qmp_command(cfd, "qmp_capabilities");
 
     return cfd;
 }
 
-static int qmp_send(int fd, const char *command)
+void qmp_set_event_handler(qmp_event_fn handler)
+{
+    event_handler = handler;
+}
+
+int qmp_send(int fd, const char *command, json_t *arguments)
 {
     _cleanup_json_ json_t *root = json_object();
     json_object_set_new(root, "execute", json_string(command));
+    json_object_set_new(root, "id", json_integer(++next_id));
+    if (arguments)
+        json_object_set_new(root, "arguments", arguments);
+
+    _cleanup_free_ char *json = json_dumps(root, JSON_COMPACT);
+    _cleanup_free_ char *line = NULL;
+    if (!json || asprintf(&line, "%s\r\n", json) < 0)
+        return 0;
+
+    /* qemu may have gone away already, that's for the caller to notice, not SIGPIPE */
+    return send(fd, line, strlen(line), MSG_NOSIGNAL);
+}
+
+static bool blank(const char *s, size_t len)
+{
+    for (; len; --len, ++s) {
+        if (!strchr(" \t\r\n", *s))
+            return false;
+    }
 
-    _cleanup_free_ char *json = json_dumps(root, 0);
-    if (json)
-        return dprintf(fd, "%s\r\n", json);
-    return 0;
+    return true;
 }
 
-static int qmp_recv(int fd)
+void qmp_close(int fd)
 {
-    char buf[BUFSIZ];
-    json_error_t error;
-    ssize_t nbytes_r = read(fd, buf, sizeof(buf));
+    drop_buffer(fd);
+    close(fd);
+}
 
-    if (nbytes_r < 0) {
-        err(1, "failed to read");
-    } else if (nbytes_r == 0) {
-        return 0;
+bool qmp_pending(int fd)
+{
+    struct qmp_buffer *buf = find_buffer(fd);
+    char *newline;
+
+    /* a complete message, not just the blank lines between them */
+    while (buf->data && (newline = memchr(buf->data, '\n', buf->len))) {
+        const size_t linelen = newline - buf->data + 1;
+        if (!blank(buf->data, linelen))
+            return true;
+
+        buf->len -= linelen;
+        memmove(buf->data, newline + 1, buf->len);
+    }
+
+    return false;
+}
+
+json_t *qmp_recv(int fd)
+{
+    struct qmp_buffer *buf = find_buffer(fd);
+
+    for (;;) {
+        char *newline = buf->data ? memchr(buf->data, '\n', buf->len) : NULL;
+
+        if (newline) {
+            const size_t linelen = newline - buf->data + 1;
+            json_error_t error;
+            json_t *root = NULL;
+
+            if (!blank(buf->data, linelen)) {
+                root = json_loadb(buf->data, linelen, 0, &error);
+                if (!root)
+                    warnx("malformed monitor message: %s", error.text);
+            }
+
+            buf->len -= linelen;
+            memmove(buf->data, newline + 1, buf->len);
+            if (root)
+                return root;
+            continue;
+        }
+
+        if (buf->len == buf->buflen) {
+            size_t newlen = buf->buflen ? buf->buflen * 2 : 4096;
+            char *data = realloc(buf->data, newlen);
+            if (!data)
+                err(EXIT_FAILURE, "failed to allocate monitor buffer");
+
+            buf->buflen = newlen;
+            buf->data = data;
+        }
+
+        ssize_t nbytes_r = read(fd, buf->data + buf->len, buf->buflen - buf->len);
+        if (nbytes_r == 0) {
+            /* qemu went away */
+            errno = ECONNRESET;
+            return NULL;
+        } else if (nbytes_r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            int saved = errno;
+            if (saved == EAGAIN)
+                warnx("timed out waiting for monitor message");
+            else
+                warn("failed to read monitor message");
+            errno = saved;
+            return NULL;
+        }
+
+        buf->len += nbytes_r;
     }
+}
+
+void qmp_dispatch(json_t *message)
+{
+    json_t *event = json_object_get(message, "event");
+
+    if (json_is_string(event) && event_handler)
+        event_handler(json_string_value(event), json_object_get(message, "data"));
+}
 
-    _cleanup_json_ json_t *root = json_loadb(buf, nbytes_r, 0, &error);
+json_t *qmp_execute(int fd, const char *command, json_t *arguments)
+{
+    if (qmp_send(fd, command, arguments) < 0)
+        return NULL;
+
+    const json_int_t id = next_id;
+
+    for (;;) {
+        _cleanup_json_ json_t *root = qmp_recv(fd);
+        if (!root)
+            return NULL;
+
+        if (json_object_get(root, "event")) {
+            qmp_dispatch(root);
+            continue;
+        }
 
-    json_t *name = json_object_get(root, "return");
-    if (!json_is_array(name))
-        return -1;
-    return 0;
+        /* skip stale replies to commands that previously timed out */
+        if (json_integer_value(json_object_get(root, "id")) != id)
+            continue;
+
+        json_t *ret = json_object_get(root, "return");
+        if (ret)
+            return json_incref(ret);
+
+        json_t *error = json_object_get(root, "error");
+        warnx("%s failed: %s", command,
+              json_string_value(json_object_get(error, "desc")));
+        return NULL;
+    }
 }
 
 int qmp_command(int fd, const char *command)
 {
-    if (qmp_send(fd, command) < 0)
-        return -1;
-    if (qmp_recv(fd) < 0)
-        return -1;
-    return 0;
+    _cleanup_json_ json_t *ret = qmp_execute(fd, command, NULL);
+    return ret ? 0 : -1;
 }
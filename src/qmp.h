@@ -1,6 +1,20 @@
 #pragma once
 
+#include <stdbool.h>
+#include <jansson.h>
+
+typedef void (*qmp_event_fn)(const char *event, json_t *data);
+
 char *qmp_sockpath(void);
 int qmp_listen(const char *sockpath);
 int qmp_accept(int fd);
+void qmp_close(int fd);
+
+void qmp_set_event_handler(qmp_event_fn handler);
+void qmp_dispatch(json_t *message);
+
+int qmp_send(int fd, const char *command, json_t *arguments);
+json_t *qmp_recv(int fd);
+bool qmp_pending(int fd);
+json_t *qmp_execute(int fd, const char *command, json_t *arguments);
 int qmp_command(int fd, const char *command);
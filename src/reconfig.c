@@ -0,0 +1,391 @@
+#include "reconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <err.h>
+#include <jansson.h>
+
+#include "qmp.h"
+#include "util.h"
+
+/*
+ * Applies the difference between two parsed profiles to the running vm.
+ * Anything that can't be changed live is reported, and picked up the
+ * next time the vm is started.
+ */
+
+static _printf_(1,2) void report(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fputs("reconfig: ", stdout);
+    vprintf(fmt, ap);
+    putchar('\n');
+    va_end(ap);
+    fflush(stdout);
+}
+
+static bool changed(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a != b;
+    return !streq(a, b);
+}
+
+static void report_restart(const char *key, const char *a, const char *b)
+{
+    if (changed(a, b))
+        report("%s changed, takes effect after restart", key);
+}
+
+static int device_del(int qmp_fd, const char *id)
+{
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "device_del", json_pack("{s:s}", "id", id));
+    return ret ? 0 : -1;
+}
+
+static unsigned long smp_count(const char *smp)
+{
+    if (!smp)
+        return 1;
+    if (strncmp(smp, "cpus=", 5) == 0)
+        smp += 5;
+    return strtoul(smp, NULL, 10);
+}
+
+static unsigned long smp_maxcpus(const char *smp)
+{
+    const char *max = smp ? strstr(smp, "maxcpus=") : NULL;
+    return max ? strtoul(max + 8, NULL, 10) : 0;
+}
+
+static const char *smp_topology(const char *smp)
+{
+    const char *topology = smp ? strchr(smp, ',') : NULL;
+    return topology ? topology : "";
+}
+
+static int plug_cpu(struct reconfig *rc, int qmp_fd)
+{
+    _cleanup_json_ json_t *cpus = qmp_execute(qmp_fd, "query-hotpluggable-cpus", NULL);
+    json_t *slot = NULL;
+    size_t idx;
+
+    /* qemu lists the highest slots first, fill from the bottom up */
+    for (idx = json_array_size(cpus); idx-- > 0;) {
+        json_t *entry = json_array_get(cpus, idx);
+        if (!json_object_get(entry, "qom-path")) {
+            slot = entry;
+            break;
+        }
+    }
+
+    if (!slot)
+        return -1;
+
+    unsigned *ids = realloc(rc->cpu_ids, (rc->cpu_ids_len + 1) * sizeof(unsigned));
+    if (!ids)
+        return -1;
+    rc->cpu_ids = ids;
+
+    char id[32];
+    unsigned generation = ++rc->generation;
+    snprintf(id, sizeof(id), "cpu-%u", generation);
+
+    json_t *args = json_object();
+    json_object_update(args, json_object_get(slot, "props"));
+    json_object_set_new(args, "driver", json_incref(json_object_get(slot, "type")));
+    json_object_set_new(args, "id", json_string(id));
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "device_add", args);
+    if (!ret)
+        return -1;
+
+    rc->cpu_ids[rc->cpu_ids_len++] = generation;
+    rc->cpus += 1;
+    return 0;
+}
+
+static int unplug_cpu(struct reconfig *rc, int qmp_fd)
+{
+    char id[32];
+
+    /* the cpus qemu was started with can't be taken away */
+    if (!rc->cpu_ids_len)
+        return -1;
+
+    snprintf(id, sizeof(id), "cpu-%u", rc->cpu_ids[rc->cpu_ids_len - 1]);
+    if (device_del(qmp_fd, id) < 0)
+        return -1;
+
+    rc->cpu_ids_len -= 1;
+    rc->cpus -= 1;
+    return 0;
+}
+
+static void apply_smp(struct reconfig *rc, int qmp_fd, const char *old, const char *new)
+{
+    if (!changed(old, new))
+        return;
+
+    if (!streq(smp_topology(old), smp_topology(new))) {
+        report("SMP topology changed, takes effect after restart");
+        return;
+    }
+
+    unsigned long count = smp_count(new), maxcpus = smp_maxcpus(old);
+    if (!maxcpus) {
+        report("SMP changed, but the vm was started without maxcpus=, takes effect after restart");
+        return;
+    } else if (!count || count > maxcpus) {
+        report("SMP=%s outside of 1-%lu cpus, ignoring", new, maxcpus);
+        return;
+    }
+
+    while (rc->cpus < count && plug_cpu(rc, qmp_fd) == 0)
+        ;
+    while (rc->cpus > count && unplug_cpu(rc, qmp_fd) == 0)
+        ;
+
+    if (rc->cpus == count)
+        report("vm now has %lu cpus", count);
+    else
+        report("could only get the vm to %lu of %lu cpus", rc->cpus, count);
+}
+
+static void apply_memory(struct reconfig *rc, int qmp_fd, uint64_t old, uint64_t new)
+{
+    if (old == new)
+        return;
+
+    if (!rc->max_memory) {
+        report("Memory changed, but the vm was started without MaxMemory=, takes effect after restart");
+        return;
+    } else if (new < rc->boot_memory || new > rc->max_memory) {
+        report("Memory=%" PRIu64 "M outside of %" PRIu64 "-%" PRIu64 " MiB, ignoring",
+               new >> 20, rc->boot_memory >> 20, rc->max_memory >> 20);
+        return;
+    }
+
+    /* boot memory is fixed, virtio-mem provides the rest */
+    json_t *args = json_pack("{s:s, s:s, s:I}", "path", "vmem0-dev",
+                             "property", "requested-size", (json_int_t)(new - rc->boot_memory));
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "qom-set", args);
+    if (ret)
+        report("resizing vm memory to %" PRIu64 " MiB", new >> 20);
+}
+
+static bool is_virtio(const struct disk_config *disk)
+{
+    return disk->interface && streq(disk->interface, "virtio");
+}
+
+static bool disk_changed(const struct disk_config *a, const struct disk_config *b)
+{
+    if (!a || !b)
+        return a != b;
+    return changed(a->path, b->path) || changed(a->interface, b->interface) ||
+           a->readonly != b->readonly;
+}
+
+static int plug_disk(struct reconfig *rc, int qmp_fd, size_t idx,
+                     const struct disk_config *disk, const char *aio)
+{
+    _cleanup_free_ char *command = NULL;
+    char *id = rc->disk_ids[idx];
+    char devid[sizeof(rc->disk_ids[idx]) + 4];
+
+    snprintf(id, sizeof(rc->disk_ids[idx]), "disk%zu-%u", idx, ++rc->generation);
+    snprintf(devid, sizeof(devid), "%s-dev", id);
+
+    /* there's no qmp equivalent of drive_add that auto-deletes with its device */
+    asprintf(&command, "drive_add 0 file=%s,if=none,id=%s,media=disk,cache=none%s%s%s",
+             disk->path, id, aio ? ",aio=" : "", aio ? aio : "",
+             disk->readonly ? ",readonly=on" : "");
+    _cleanup_json_ json_t *out = qmp_execute(qmp_fd, "human-monitor-command",
+                                             json_pack("{s:s}", "command-line", command));
+    const char *reply = json_string_value(out);
+    if (!reply || strncmp(reply, "OK", 2) != 0) {
+        warnx("drive_add failed: %s", reply ? reply : "no reply");
+        id[0] = '\0';
+        return -1;
+    }
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "device_add",
+                                             json_pack("{s:s, s:s, s:s}", "driver", "virtio-blk-pci",
+                                                       "drive", id, "id", devid));
+    if (!ret) {
+        id[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+static void apply_disk(struct reconfig *rc, int qmp_fd, size_t idx, const char *aio,
+                       const struct disk_config *old, const struct disk_config *new)
+{
+    char devid[sizeof(rc->disk_ids[idx]) + 4];
+
+    if (!disk_changed(old, new))
+        return;
+
+    /* only virtio disks are plugged in as devices of their own */
+    if (!rc->disk_hotplug || (old && !is_virtio(old)) || (new && !is_virtio(new))) {
+        report("disk %zu changed, takes effect after restart", idx);
+        return;
+    }
+
+    if (rc->disk_ids[idx][0]) {
+        snprintf(devid, sizeof(devid), "%s-dev", rc->disk_ids[idx]);
+        if (device_del(qmp_fd, devid) < 0)
+            return;
+
+        report("detached %s", rc->disk_ids[idx]);
+        rc->disk_ids[idx][0] = '\0';
+    }
+
+    if (new && plug_disk(rc, qmp_fd, idx, new, aio) == 0)
+        report("attached %s as %s", new->path, rc->disk_ids[idx]);
+}
+
+static bool nic_changed(const struct nic_config *a, const struct nic_config *b)
+{
+    if (!a || !b)
+        return a != b;
+    return changed(a->interface, b->interface) || changed(a->model, b->model) ||
+           changed(a->macaddr, b->macaddr);
+}
+
+int reconfig_plug_nic(struct reconfig *rc, int qmp_fd, size_t idx, const struct nic_config *nic)
+{
+    json_t *netdev;
+
+    if (nic->interface) {
+        netdev = json_pack("{s:s, s:s, s:s, s:s, s:s}", "type", "tap", "id", rc->netdev_ids[idx],
+                           "ifname", nic->interface, "script", "no", "downscript", "no");
+        if (nic->vhost)
+            json_object_set_new(netdev, "vhost", json_true());
+    } else {
+        netdev = json_pack("{s:s, s:s}", "type", "user", "id", rc->netdev_ids[idx]);
+    }
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "netdev_add", netdev);
+    if (!ret)
+        return -1;
+
+    _cleanup_json_ json_t *dev = qmp_execute(qmp_fd, "device_add",
+                                             json_pack("{s:s, s:s, s:s, s:s}",
+                                                       "driver", nic_driver(nic->model),
+                                                       "id", rc->nic_ids[idx], "netdev", rc->netdev_ids[idx],
+                                                       "mac", nic->macaddr));
+    if (!dev) {
+        /* don't leave a netdev behind that no nic will ever use */
+        _cleanup_json_ json_t *del = qmp_execute(qmp_fd, "netdev_del",
+                                                 json_pack("{s:s}", "id", rc->netdev_ids[idx]));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void apply_nic(struct reconfig *rc, int qmp_fd, size_t idx,
+                      const struct nic_config *old, const struct nic_config *new)
+{
+    if (!nic_changed(old, new))
+        return;
+
+    if (!rc->nic_hotplug) {
+        report("nic %zu changed, takes effect after restart", idx);
+        return;
+    }
+
+    if (rc->nic_ids[idx][0]) {
+        if (device_del(qmp_fd, rc->nic_ids[idx]) < 0)
+            return;
+
+        /* qemu holds on to the netdev until the nic is really gone */
+        _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "netdev_del",
+                                                 json_pack("{s:s}", "id", rc->netdev_ids[idx]));
+        report("detached %s", rc->nic_ids[idx]);
+        rc->nic_ids[idx][0] = '\0';
+    }
+
+    if (new) {
+        unsigned generation = ++rc->generation;
+        snprintf(rc->netdev_ids[idx], sizeof(rc->netdev_ids[idx]), "net%zu-%u", idx, generation);
+        snprintf(rc->nic_ids[idx], sizeof(rc->nic_ids[idx]), "nic%zu-%u", idx, generation);
+
+        if (reconfig_plug_nic(rc, qmp_fd, idx, new) == 0)
+            report("attached %s with mac %s", rc->nic_ids[idx], new->macaddr);
+        else
+            rc->nic_ids[idx][0] = '\0';
+    }
+}
+
+void reconfig_init(struct reconfig *rc, const struct qemu_config_t *config)
+{
+    size_t idx;
+
+    zero(rc, sizeof(struct reconfig));
+
+    rc->disk_hotplug = !config->snapshot && !config->template && !config->clone;
+    rc->nic_hotplug = !config->template;
+
+    for (idx = 0; idx < config->disks_len; ++idx)
+        snprintf(rc->disk_ids[idx], sizeof(rc->disk_ids[idx]), "disk%zu", idx);
+    for (idx = 0; idx < config->nics_len; ++idx) {
+        snprintf(rc->netdev_ids[idx], sizeof(rc->netdev_ids[idx]), "net%zu", idx);
+        snprintf(rc->nic_ids[idx], sizeof(rc->nic_ids[idx]), "nic%zu", idx);
+    }
+
+    rc->cpus = smp_count(config->smp);
+    if (config->max_memory_size) {
+        rc->boot_memory = config->memory_size;
+        rc->max_memory = config->max_memory_size;
+    }
+}
+
+void reconfig_apply(struct reconfig *rc, int qmp_fd,
+                    const struct qemu_config_t *old, const struct qemu_config_t *new)
+{
+    size_t idx;
+
+    report_restart("Machine", old->machine, new->machine);
+    report_restart("CPU", old->cpu, new->cpu);
+    report_restart("MemoryFile", old->memory_file, new->memory_file);
+    report_restart("RealTimeClock", old->rtc, new->rtc);
+    report_restart("Graphics", old->graphics, new->graphics);
+    report_restart("SoundHardware", old->soundhw, new->soundhw);
+    report_restart("SerialPort", old->serial, new->serial);
+    report_restart("Template", old->template_dir, new->template_dir);
+    report_restart("SnapshotDirectory", old->snapshot_dir, new->snapshot_dir);
+
+    if (old->max_memory_size != new->max_memory_size)
+        report("MaxMemory changed, takes effect after restart");
+    if (old->memory_merge != new->memory_merge)
+        report("MemoryMerge changed, takes effect after restart");
+    if (old->disable_hugepages != new->disable_hugepages)
+        report("DisableTransparentHugePages changed, takes effect after restart");
+    if (old->cluster_size != new->cluster_size)
+        report("SnapshotClusterSize changed, takes effect after restart");
+    if (old->guest_agent != new->guest_agent)
+        report("GuestAgent changed, takes effect after restart");
+    if (old->prewarm != new->prewarm)
+        report("Prewarm changed, takes effect after restart");
+
+    apply_smp(rc, qmp_fd, old->smp, new->smp);
+    apply_memory(rc, qmp_fd, old->memory_size, new->memory_size);
+
+    for (idx = 0; idx < CONFIG_MAX_DISKS; ++idx)
+        apply_disk(rc, qmp_fd, idx, new->disk_aio, idx < old->disks_len ? &old->disks[idx] : NULL,
+                   idx < new->disks_len ? &new->disks[idx] : NULL);
+    for (idx = 0; idx < CONFIG_MAX_NICS; ++idx)
+        apply_nic(rc, qmp_fd, idx, idx < old->nics_len ? &old->nics[idx] : NULL,
+                  idx < new->nics_len ? &new->nics[idx] : NULL);
+}
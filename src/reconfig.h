@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+struct reconfig {
+    unsigned generation;
+
+    /* ids of the devices as currently plugged into the vm, empty if unplugged */
+    char disk_ids[CONFIG_MAX_DISKS][32];
+    char netdev_ids[CONFIG_MAX_NICS][32];
+    char nic_ids[CONFIG_MAX_NICS][32];
+
+    bool disk_hotplug;
+    bool nic_hotplug;
+
+    unsigned long cpus;
+    unsigned *cpu_ids;
+    size_t cpu_ids_len;
+
+    uint64_t boot_memory;
+    uint64_t max_memory;
+};
+
+void reconfig_init(struct reconfig *rc, const struct qemu_config_t *config);
+int reconfig_plug_nic(struct reconfig *rc, int qmp_fd, size_t idx, const struct nic_config *nic);
+void reconfig_apply(struct reconfig *rc, int qmp_fd,
+                    const struct qemu_config_t *old, const struct qemu_config_t *new);
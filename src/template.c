@@ -0,0 +1,82 @@
+#include "template.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <jansson.h>
+
+#include "qmp.h"
+#include "util.h"
+
+/*
+ * Templates keep guest ram in a shared memory-backend-file, so only the
+ * device state needs to go through the migration stream. x-ignore-shared
+ * tells qemu to skip the shared ram on both the saving and loading side.
+ */
+static int ignore_shared_ram(int qmp_fd)
+{
+    json_t *args = json_pack("{s:[{s:s, s:b}]}", "capabilities",
+                             "capability", "x-ignore-shared", "state", 1);
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "migrate-set-capabilities", args);
+    return ret ? 0 : -1;
+}
+
+static int wait_for_migration(int qmp_fd)
+{
+    const struct timespec interval = { .tv_nsec = 100 * 1000000 };
+
+    for (;;) {
+        _cleanup_json_ json_t *info = qmp_execute(qmp_fd, "query-migrate", NULL);
+        if (!info)
+            return -1;
+
+        const char *status = json_string_value(json_object_get(info, "status"));
+        if (!status) {
+            warnx("no migration in progress");
+            return -1;
+        } else if (streq(status, "completed")) {
+            return 0;
+        } else if (streq(status, "failed") || streq(status, "cancelled")) {
+            warnx("migration %s: %s", status,
+                  json_string_value(json_object_get(info, "error-desc")));
+            return -1;
+        }
+
+        nanosleep(&interval, NULL);
+    }
+}
+
+int template_save(int qmp_fd, const char *statepath)
+{
+    _cleanup_free_ char *uri = NULL;
+    asprintf(&uri, "exec:cat > '%s'", statepath);
+
+    if (qmp_command(qmp_fd, "stop") < 0)
+        return -1;
+    if (ignore_shared_ram(qmp_fd) < 0)
+        return -1;
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "migrate", json_pack("{s:s}", "uri", uri));
+    if (!ret)
+        return -1;
+
+    return wait_for_migration(qmp_fd);
+}
+
+int template_restore(int qmp_fd, const char *statepath)
+{
+    _cleanup_free_ char *uri = NULL;
+    asprintf(&uri, "exec:cat '%s'", statepath);
+
+    if (ignore_shared_ram(qmp_fd) < 0)
+        return -1;
+
+    _cleanup_json_ json_t *ret = qmp_execute(qmp_fd, "migrate-incoming", json_pack("{s:s}", "uri", uri));
+    if (!ret || wait_for_migration(qmp_fd) < 0)
+        return -1;
+
+    /* the template was stopped when it was saved, and the clone inherits that */
+    return qmp_command(qmp_fd, "cont");
+}
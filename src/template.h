@@ -0,0 +1,4 @@
+#pragma once
+
+int template_save(int qmp_fd, const char *statepath);
+int template_restore(int qmp_fd, const char *statepath);